@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Logger.h"
+
+// Pool of worker threads whose size follows the measured latency of the files they hydrate.
+// Hydration mostly waits on the sync provider, so the right number of threads depends on its
+// latency and capacity rather than on the number of cores. A controller samples the workers
+// twice a second and adjusts the number of active ones like TCP Vegas adjusts its window:
+// the latency per file is compared to the lowest latency seen recently, and the difference
+// tells how many of the active threads are only queueing in the provider. While hardly any
+// are, the pool grows, doubling at first like slow start and then by an eighth; when many
+// are, it shrinks by an eighth. Intervals in which the workers were starved by the traversal
+// say nothing about the provider and leave the size alone. With equal minimum and maximum
+// the pool has a fixed size and no controller.
+class AdaptivePool {
+public:
+    using Worker = std::function<void(unsigned index)>;
+
+    AdaptivePool(unsigned min_threads, unsigned max_threads, unsigned initial_threads)
+        : min_threads_(std::max(1u, min_threads)), max_threads_(std::max(min_threads_, max_threads)), slots_(max_threads_) {
+        target_ = std::clamp(initial_threads, min_threads_, max_threads_);
+    }
+
+    AdaptivePool(const AdaptivePool&) = delete;
+    AdaptivePool& operator=(const AdaptivePool&) = delete;
+
+    ~AdaptivePool() {
+        finish();
+    }
+
+    // Starts the initial workers and, if the size may change, the controller.
+    void start(Worker worker) {
+        worker_ = std::move(worker);
+        std::lock_guard<std::mutex> lock(mutex_);
+        spawnUpToTarget();
+        if (min_threads_ != max_threads_) {
+            controller_ = std::thread([this]() { control(); });
+        }
+    }
+
+    // Called by a worker before it takes more work. Parks the worker while the pool is
+    // smaller than its index. Returns false when the worker should exit.
+    bool waitUntilActive(unsigned index) {
+        if (index < target_.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        resized_.wait(lock, [&]() { return index < target_.load(std::memory_order_relaxed) || stopped_; });
+        return !stopped_;
+    }
+
+    // Called by a worker after each file: whether it was opened, and the time it took.
+    void record(unsigned index, uint64_t files, std::chrono::steady_clock::duration busy) {
+        Slot& slot = slots_[index];
+        slot.files.fetch_add(files, std::memory_order_relaxed);
+        slot.busy_ns.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count()), std::memory_order_relaxed);
+    }
+
+    // Waits for the workers after the queue was closed. The pool keeps adapting while the
+    // active workers drain the queue; once one of them finds it empty the controller stops
+    // and the parked workers exit.
+    void finish() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            drained_.wait(lock, [&]() { return drained_count_ > 0 || threads_.empty(); });
+            if (stopped_) {
+                return;
+            }
+            stopped_ = true;
+        }
+        resized_.notify_all();
+        stop_.notify_all();
+        if (controller_.joinable()) {
+            controller_.join();
+        }
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Number of workers active now.
+    unsigned size() const {
+        return target_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr std::chrono::milliseconds kInterval{ 500 };
+    static constexpr std::chrono::seconds kBaseLatencyLifetime{ 10 };
+
+    // Per-worker counters, on their own cache line so workers do not contend.
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> files{ 0 };
+        std::atomic<uint64_t> busy_ns{ 0 };
+    };
+
+    // Starts the threads needed to reach the target. Called with mutex_ held.
+    void spawnUpToTarget() {
+        while (threads_.size() < target_.load(std::memory_order_relaxed)) {
+            unsigned index = static_cast<unsigned>(threads_.size());
+            threads_.emplace_back([this, index]() {
+                worker_(index);
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++drained_count_;
+                drained_.notify_all();
+            });
+        }
+    }
+
+    void resize(unsigned target, double latency_ms, double files_per_second) {
+        unsigned current = target_.load(std::memory_order_relaxed);
+        target = std::clamp(target, min_threads_, max_threads_);
+        if (target == current) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            target_.store(target, std::memory_order_relaxed);
+            spawnUpToTarget();
+        }
+        resized_.notify_all();
+        logger.log(LogLevel::Info, "Threads: ", current, " -> ", target, " (", latency_ms, " ms per file, ", files_per_second, " files/s)");
+    }
+
+    void control() {
+        using Clock = std::chrono::steady_clock;
+        uint64_t last_files = 0;
+        uint64_t last_busy_ns = 0;
+        Clock::time_point last_sample = Clock::now();
+        double base_latency_ns = 0;
+        Clock::time_point base_latency_time;
+        bool slow_start = true;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_.wait_for(lock, kInterval, [&]() { return stopped_; })) {
+            lock.unlock();
+
+            uint64_t files = 0;
+            uint64_t busy_ns = 0;
+            for (const Slot& slot : slots_) {
+                files += slot.files.load(std::memory_order_relaxed);
+                busy_ns += slot.busy_ns.load(std::memory_order_relaxed);
+            }
+            Clock::time_point now = Clock::now();
+            double elapsed_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_sample).count());
+            uint64_t interval_files = files - last_files;
+            double interval_busy_ns = static_cast<double>(busy_ns - last_busy_ns);
+            last_files = files;
+            last_busy_ns = busy_ns;
+            last_sample = now;
+
+            unsigned active = target_.load(std::memory_order_relaxed);
+            double utilization = interval_busy_ns / (elapsed_ns * active);
+            if (interval_files >= active && utilization >= 0.75) {
+                double latency_ns = interval_busy_ns / static_cast<double>(interval_files);
+                if (base_latency_ns == 0 || latency_ns < base_latency_ns || now - base_latency_time > kBaseLatencyLifetime) {
+                    base_latency_ns = latency_ns;
+                    base_latency_time = now;
+                }
+
+                // Threads that only add queueing delay on top of the base latency.
+                double queueing = active * (1.0 - base_latency_ns / latency_ns);
+                double low = std::max(1.0, active / 16.0);
+                double high = std::max(2.0, active / 4.0);
+                unsigned step = std::max(1u, active / 8);
+                double latency_ms = latency_ns / 1e6;
+                double files_per_second = interval_files * 1e9 / elapsed_ns;
+                if (queueing < low) {
+                    resize(slow_start ? active * 2 : active + step, latency_ms, files_per_second);
+                }
+                else if (queueing > high) {
+                    slow_start = false;
+                    resize(active - step, latency_ms, files_per_second);
+                }
+            }
+
+            lock.lock();
+        }
+    }
+
+    const unsigned min_threads_;
+    const unsigned max_threads_;
+    std::vector<Slot> slots_;
+    std::atomic<unsigned> target_{ 0 };
+    Worker worker_;
+
+    std::mutex mutex_;
+    std::condition_variable resized_;
+    std::condition_variable stop_;
+    std::condition_variable drained_;
+    unsigned drained_count_ = 0;
+    bool stopped_ = false;
+    std::vector<std::thread> threads_;
+    std::thread controller_;
+};
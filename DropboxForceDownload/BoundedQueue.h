@@ -0,0 +1,87 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Multi-producer/multi-consumer queue with a fixed capacity. Producers block while the
+// queue is full, so a traversal that outruns the workers is throttled instead of buffering
+// the whole tree in memory.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity == 0 ? 1 : capacity) {}
+
+    // Blocks while the queue is full. Returns false if the queue was closed.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return items_.size() < capacity_ || closed_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(item));
+        if (items_.size() > high_water_mark_) {
+            high_water_mark_ = items_.size();
+        }
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. Returns false once the queue is closed and drained.
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Pops an item if one is queued, without waiting. For consumers that have other work.
+    bool poll(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Wakes every waiting thread. Items already queued can still be popped.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Largest number of items that were queued at the same time.
+    size_t highWaterMark() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return high_water_mark_;
+    }
+
+private:
+    const size_t capacity_;
+    mutable std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<T> items_;
+    size_t high_water_mark_ = 0;
+    bool closed_ = false;
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "FileBatch.h"
+
+// Modification time and link count of a directory, taken before it is listed.
+struct DirectoryStamp {
+    int64_t mtime = 0;
+    // 2 + the number of subdirectories on most POSIX file systems, 0 where unknown.
+    uint64_t links = 0;
+};
+
+// Function to stamp a directory, through its descriptor if it has one. Returns false if the
+// directory cannot be stat'ed.
+inline bool stampDirectory(const Directory& directory, DirectoryStamp& stamp) {
+#ifdef _WIN32
+    std::error_code error;
+    auto mtime = std::filesystem::last_write_time(directory.path, error);
+    if (error) {
+        return false;
+    }
+    stamp.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    stamp.links = 0;
+#else
+    struct stat status;
+    int result = directory.fd >= 0 ? fstat(directory.fd, &status) : stat(directory.path.c_str(), &status);
+    if (result != 0) {
+        return false;
+    }
+#ifdef __APPLE__
+    stamp.mtime = static_cast<int64_t>(status.st_mtimespec.tv_sec) * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+    stamp.mtime = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+    stamp.links = static_cast<uint64_t>(status.st_nlink);
+#endif
+    return true;
+}
+
+// Snapshot of the directories seen by a run, used to prune the next run. Adding, removing or
+// renaming an entry changes the modification time of its directory, so a directory whose
+// mtime and subdirectory count are unchanged, and whose files were all hydrated last time,
+// is not listed again: the traversal only descends into the subdirectories remembered in the
+// snapshot, which are judged the same way. Files changed in place, or turned back into
+// placeholders, without touching their directory are not noticed.
+class DirectorySnapshot {
+public:
+    using String = std::filesystem::path::string_type;
+
+    DirectorySnapshot(std::filesystem::path file_path, const std::filesystem::path& root)
+        : file_path_(std::move(file_path)), root_(root.native()), run_start_(std::chrono::system_clock::now()) {
+        load();
+    }
+
+    // Checks whether a directory can be skipped. If so, returns the names of its subdirectories
+    // from the previous run and carries its record over to the new snapshot, as the outcome of
+    // the directory.
+    bool reuse(const Directory& directory, const DirectoryStamp& stamp, std::vector<String>& subdirectories) {
+        auto previous = previous_.find(directory.path.native());
+        if (previous == previous_.end() || !previous->second.complete || previous->second.mtime != stamp.mtime) {
+            return false;
+        }
+        // Where the link count tracks subdirectories it has to match as well.
+        if (stamp.links >= 2 && previous->second.subdirectories + 2 != stamp.links) {
+            return false;
+        }
+
+        auto children = children_.find(directory.path.native());
+        if (children != children_.end()) {
+            subdirectories = children->second;
+        }
+        else {
+            subdirectories.clear();
+        }
+
+        Record& record = addRecord(directory, stamp);
+        record.subdirectories = previous->second.subdirectories;
+        record.listed = true;
+        directory.outcome = &record;
+        reused_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Starts the record of a directory that is about to be listed. Workers mark the returned
+    // outcome incomplete when one of its files cannot be hydrated.
+    DirectoryOutcome* startRecord(const Directory& directory, const DirectoryStamp& stamp) {
+        return &addRecord(directory, stamp);
+    }
+
+    // Completes a record started by startRecord once the directory has been listed.
+    void finishRecord(DirectoryOutcome* outcome, uint64_t subdirectories) {
+        Record* record = static_cast<Record*>(outcome);
+        record->subdirectories = subdirectories;
+        record->listed = true;
+    }
+
+    // Number of directories recorded by the previous run.
+    size_t previousSize() const {
+        return previous_.size();
+    }
+
+    // Number of directories skipped by this run.
+    size_t reusedCount() const {
+        return reused_.load(std::memory_order_relaxed);
+    }
+
+    // Writes the new snapshot next to the old one and replaces it. Called after the workers
+    // finished, so every outcome is final.
+    void save() const {
+        // A directory modified within the timestamp granularity of the file system before it was
+        // listed may change again without a visible mtime change, so it is listed again next time.
+        int64_t racy_after = mtimeOf(run_start_ - std::chrono::seconds(2));
+
+        std::filesystem::path temporary_path = file_path_;
+        temporary_path += ".tmp";
+        {
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            file.write(kMagic, sizeof(kMagic));
+            writeString(file, root_);
+            for (const Record& record : current_) {
+                bool complete = record.listed && record.complete.load(std::memory_order_relaxed) && record.mtime < racy_after;
+                writeValue(file, record.mtime);
+                writeValue(file, record.subdirectories);
+                writeValue(file, static_cast<uint8_t>(complete ? 1 : 0));
+                writeString(file, record.path);
+            }
+            if (!file) {
+                throw std::system_error(errno, std::generic_category(), "Unable to write snapshot file " + temporary_path.string());
+            }
+        }
+        std::filesystem::rename(temporary_path, file_path_);
+    }
+
+private:
+    static constexpr char kMagic[8] = { 'D', 'F', 'D', 'S', 'N', 'A', 'P', '1' };
+
+    // A directory of this run. Records live in a deque, so the outcome pointers handed to
+    // the workers stay valid while more directories are added.
+    struct Record : DirectoryOutcome {
+        String path;
+        int64_t mtime = 0;
+        uint64_t subdirectories = 0;
+        bool listed = false;
+    };
+
+    // A directory of the previous run.
+    struct PreviousRecord {
+        int64_t mtime = 0;
+        uint64_t subdirectories = 0;
+        bool complete = false;
+    };
+
+    Record& addRecord(const Directory& directory, const DirectoryStamp& stamp) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Record& record = current_.emplace_back();
+        record.path = directory.path.native();
+        record.mtime = stamp.mtime;
+        return record;
+    }
+
+    // Converts a point in time to the clock of DirectoryStamp::mtime.
+    static int64_t mtimeOf(std::chrono::system_clock::time_point time) {
+#ifdef _WIN32
+        auto file_time = std::filesystem::file_time_type::clock::now() - (std::chrono::system_clock::now() - time);
+        return static_cast<int64_t>(file_time.time_since_epoch().count());
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+#endif
+    }
+
+    template <typename T>
+    static void writeValue(std::ofstream& file, T value) {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool readValue(std::ifstream& file, T& value) {
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    static void writeString(std::ofstream& file, const String& text) {
+        writeValue(file, static_cast<uint32_t>(text.size()));
+        file.write(reinterpret_cast<const char*>(text.data()), text.size() * sizeof(String::value_type));
+    }
+
+    // A longer string can only come from a damaged snapshot, it ends the snapshot before it is
+    // allocated. Windows limits paths to 32767 characters.
+    static constexpr uint32_t kMaxStringLength = 32768;
+
+    static bool readString(std::ifstream& file, String& text) {
+        uint32_t length = 0;
+        if (!readValue(file, length) || length > kMaxStringLength) {
+            return false;
+        }
+        text.resize(length);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(&text[0]), length * sizeof(String::value_type)));
+    }
+
+    // Loads the previous snapshot. A missing or damaged snapshot, or one of another root
+    // directory, just means nothing is skipped.
+    void load() {
+        std::ifstream file(file_path_, std::ios::binary);
+        char magic[sizeof(kMagic)];
+        String root;
+        if (!file || !file.read(magic, sizeof(magic)) || std::char_traits<char>::compare(magic, kMagic, sizeof(kMagic)) != 0 ||
+            !readString(file, root) || root != root_) {
+            return;
+        }
+
+        String path;
+        PreviousRecord record;
+        uint8_t complete = 0;
+        while (readValue(file, record.mtime) && readValue(file, record.subdirectories) && readValue(file, complete) && readString(file, path)) {
+            record.complete = complete != 0;
+            if (path != root_) {
+                std::filesystem::path child(path);
+                children_[child.parent_path().native()].push_back(child.filename().native());
+            }
+            previous_[path] = record;
+        }
+    }
+
+    std::filesystem::path file_path_;
+    String root_;
+    std::chrono::system_clock::time_point run_start_;
+    std::unordered_map<String, PreviousRecord> previous_;
+    std::unordered_map<String, std::vector<String>> children_;
+    std::atomic<size_t> reused_{ 0 };
+    std::mutex mutex_;
+    std::deque<Record> current_;
+};
@@ -1,142 +1,350 @@
 #include <iostream>
 #include <filesystem>
-#include <fstream>
 #include <vector>
 #include <thread>
-#include <queue>
 #include <stdexcept>
 #include <mutex>
-#include <condition_variable>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <system_error>
+#include "Logger.h"
+#include "Options.h"
+#include "Pipeline.h"
 
 namespace fs = std::filesystem;
 std::mutex console_mutex;
+Logger logger;
 
-// Function to replace double backslashes with single ones in file paths for display.
-std::string replaceAll(std::string str, const std::string& from, const std::string& to) {
-    size_t start_pos = 0;
-    while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
-        str.replace(start_pos, from.length(), to);
-        start_pos += to.length();
+// Function to parse a positive count from a command line argument.
+template <typename T>
+bool parseCount(const char* text, T& value) {
+    char* end = nullptr;
+    unsigned long long parsed = std::strtoull(text, &end, 10);
+    if (end == text || *end != '\0' || parsed == 0 || parsed > static_cast<unsigned long long>(std::numeric_limits<T>::max())) {
+        return false;
     }
-    return str;
+    value = static_cast<T>(parsed);
+    return true;
 }
 
-// Function to process individual files.
-void processFile(const fs::path& file_path, bool debug) {
-    if (file_path.empty()) {
-        std::cerr << "Encountered an empty file path." << std::endl;
-        return;
+// Function to parse the command line. Returns false if the arguments are invalid.
+bool parseArguments(int argc, char* argv[], fs::path& dropbox_path, Options& options) {
+    if (argc < 2) {
+        return false;
     }
+    dropbox_path = argv[1];
 
-    if (debug) {
-        std::string path_str = file_path.string();
-        path_str = replaceAll(path_str, "\\\\", "\\");
-        std::lock_guard<std::mutex> guard(console_mutex);
-        std::cout << "Downloading file: " << path_str << std::endl;
-    }
-
-    std::ifstream file(file_path, std::ios::binary);
-    if (file.is_open()) {
-        char buffer[1024]; // Read only the first 1 KB
-        file.read(buffer, sizeof(buffer));
-    }
-    else {
-        std::cerr << "Unable to open file: " << file_path << std::endl;
-    }
-}
-
-// Recursive function to traverse directories and enqueue files for processing.
-void traverseDirectory(const fs::path& directory_path, bool debug, std::queue<fs::path>& files, std::mutex& queue_mutex, std::condition_variable& cv) {
-    for (const auto& entry : fs::directory_iterator(directory_path)) {
-        if (fs::is_regular_file(entry.status())) {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            files.push(entry.path());
-            cv.notify_one();
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "debug") {
+            options.log_level = LogLevel::Debug;
         }
-        else if (fs::is_directory(entry.status())) {
-            traverseDirectory(entry.path(), debug, files, queue_mutex, cv);
+        else if (arg == "--log-level" && has_value) {
+            std::string level = argv[++i];
+            if (level == "error") {
+                options.log_level = LogLevel::Error;
+            }
+            else if (level == "warning") {
+                options.log_level = LogLevel::Warning;
+            }
+            else if (level == "info") {
+                options.log_level = LogLevel::Info;
+            }
+            else if (level == "debug") {
+                options.log_level = LogLevel::Debug;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--log-file" && has_value) {
+            options.log_file = argv[++i];
+        }
+        else if (arg == "--metrics-out" && has_value) {
+            options.metrics_out = argv[++i];
+        }
+        else if (arg == "--metrics-interval" && has_value) {
+            if (!parseCount(argv[++i], options.metrics_interval)) {
+                return false;
+            }
+        }
+        else if (arg == "--trace" && has_value) {
+            options.trace_file = argv[++i];
+        }
+        else if (arg == "--trace-events" && has_value) {
+            if (!parseCount(argv[++i], options.trace_events)) {
+                return false;
+            }
+        }
+        else if (arg == "--simulate" && has_value) {
+            if (!parseSimulation(argv[++i], options.simulation)) {
+                return false;
+            }
+        }
+        else if (arg == "--progress") {
+            options.progress = ProgressDisplay::Always;
+        }
+        else if (arg == "--no-progress") {
+            options.progress = ProgressDisplay::Never;
+        }
+        else if (arg == "--parallel-traversal") {
+            options.parallel_traversal = true;
+        }
+        else if (arg == "--traversal-threads" && has_value) {
+            if (!parseCount(argv[++i], options.traversal_threads)) {
+                return false;
+            }
+        }
+#ifndef _WIN32
+        else if (arg == "--dirfd") {
+            options.dirfd = true;
+        }
+#endif
+#ifdef __linux__
+        else if (arg == "--readdir") {
+            options.getdents = false;
+        }
+#endif
+        else if (arg == "--threads" && has_value) {
+            if (!parseCount(argv[++i], options.threads)) {
+                return false;
+            }
+        }
+        else if (arg == "--min-threads" && has_value) {
+            if (!parseCount(argv[++i], options.min_threads)) {
+                return false;
+            }
+        }
+        else if (arg == "--max-threads" && has_value) {
+            if (!parseCount(argv[++i], options.max_threads)) {
+                return false;
+            }
+        }
+        else if (arg == "--batch-size" && has_value) {
+            if (!parseCount(argv[++i], options.batch_size)) {
+                return false;
+            }
+        }
+        else if (arg == "--engine" && has_value) {
+            std::string engine = argv[++i];
+            if (engine == "threads") {
+                options.engine = Engine::Threads;
+            }
+            else if (engine == "uring") {
+                options.engine = Engine::Uring;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--uring-depth" && has_value) {
+            if (!parseCount(argv[++i], options.uring_depth)) {
+                return false;
+            }
+        }
+        else if (arg == "--uring-threads" && has_value) {
+            if (!parseCount(argv[++i], options.uring_threads)) {
+                return false;
+            }
+        }
+        else if (arg == "--reader" && has_value) {
+            std::string reader = argv[++i];
+            if (reader == "ifstream") {
+                options.reader = Reader::Stream;
+            }
+#ifndef _WIN32
+            else if (reader == "posix") {
+                options.reader = Reader::Posix;
+            }
+#endif
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--hydrate" && has_value) {
+            std::string mode = argv[++i];
+            if (mode == "head") {
+                options.hydration = Hydration::Head;
+            }
+            else if (mode == "tail") {
+                options.hydration = Hydration::Tail;
+            }
+            else if (mode == "stride") {
+                options.hydration = Hydration::Stride;
+            }
+            else if (mode == "full") {
+                options.hydration = Hydration::Full;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--hydrate-bytes" && has_value) {
+            if (!parseCount(argv[++i], options.hydration_bytes)) {
+                return false;
+            }
+        }
+        else if (arg == "--hydrate-stride" && has_value) {
+            if (!parseCount(argv[++i], options.hydration_stride)) {
+                return false;
+            }
+        }
+        else if (arg == "--read-buffer" && has_value) {
+            if (!parseCount(argv[++i], options.read_buffer_size)) {
+                return false;
+            }
+        }
+#ifndef _WIN32
+        else if (arg == "--direct") {
+            options.direct_io = true;
+        }
+        else if (arg == "--drop-cache") {
+            options.drop_cache = true;
+        }
+#endif
+        else if (arg == "--skip-resident" && has_value) {
+            std::string check = argv[++i];
+#ifdef _WIN32
+            if (check == "attributes") {
+                options.residency_check = ResidencyCheck::Attributes;
+            }
+#else
+            if (check == "blocks") {
+                options.residency_check = ResidencyCheck::Blocks;
+            }
+            else if (check == "holes") {
+                options.residency_check = ResidencyCheck::BlocksAndHoles;
+            }
+#endif
+            else {
+                return false;
+            }
+        }
+#ifndef _WIN32
+        else if (arg == "--state-file" && has_value) {
+            options.state_file = argv[++i];
+        }
+#endif
+        else if (arg == "--snapshot-file" && has_value) {
+            options.snapshot_file = argv[++i];
+        }
+        else if (arg == "--queue" && has_value) {
+            std::string kind = argv[++i];
+            if (kind == "lockfree") {
+                options.queue = QueueKind::LockFree;
+            }
+            else if (kind == "mutex") {
+                options.queue = QueueKind::Mutex;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--queue-capacity" && has_value) {
+            if (!parseCount(argv[++i], options.queue_capacity)) {
+                return false;
+            }
+        }
+        else {
+            return false;
         }
     }
-}
-
-// Function to start directory traversal and manage threads.
-void startDirectoryTraversal(const fs::path& directory_path, bool debug) {
-    std::vector<std::thread> workers;
-    std::queue<fs::path> files;
-    std::mutex queue_mutex;
-    std::condition_variable cv;
-    bool done = false;
-
-    // Worker function for threads to process files from the queue.
-    auto worker = [&]() {
-        while (true) {
-            fs::path file_path;
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                cv.wait(lock, [&] { return !files.empty() || done; });
-                if (done && files.empty()) {
-                    break;
-                }
-                file_path = files.front();
-                files.pop();
-            }
-            processFile(file_path, debug);
-        }
-    };
-
-    // Creating a pool of worker threads.
-    int max_threads = std::thread::hardware_concurrency();
-    if (debug) {
-        std::cout << "Threads: " << max_threads << std::endl;
-    }
-
-    for (int i = 0; i < max_threads; ++i) {
-        workers.emplace_back(worker);
-    }
-
-    // Starting the recursive directory traversal.
-    traverseDirectory(directory_path, debug, files, queue_mutex, cv);
-
-    // Signaling the workers that traversal is complete.
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        done = true;
-        cv.notify_all();
+#ifndef _WIN32
+    // std::ifstream opens files by their full path, it cannot open them relative to a directory.
+    if (options.dirfd && options.reader == Reader::Stream) {
+        return false;
     }
+#endif
+    return true;
+}
 
-    // Joining all worker threads.
-    for (auto& worker : workers) {
-        worker.join();
-    }
+// Function to print the command line help.
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " <DropboxFolderPath> [debug] [options]" << std::endl
+              << "Options:" << std::endl
+              << "  --log-level <level>       error, warning (default), info or debug; \"debug\" is the same as --log-level debug" << std::endl
+              << "  --log-file <path>         Write the log to a file instead of the console" << std::endl
+              << "  --metrics-out <prefix>    Write metrics to <prefix>.json and <prefix>.prom at the end of the run" << std::endl
+              << "  --metrics-interval <s>    With --metrics-out, also write the metrics every s seconds" << std::endl
+              << "  --trace <path>            Write a Chrome trace of the traversal and the workers, for Perfetto" << std::endl
+              << "  --trace-events <n>        Spans kept per thread for --trace, older ones are dropped (default: 65536)" << std::endl
+              << "  --simulate <settings>     Delay and fail opens and listings like a sync provider, e.g. open=20ms/400ms,rate=200" << std::endl
+              << "  --progress                Always show the status line (default: when stderr is a terminal and not debug)" << std::endl
+              << "  --no-progress             Never show the status line" << std::endl
+              << "  --parallel-traversal      Enumerate directories on a work-stealing thread pool" << std::endl
+              << "  --traversal-threads <n>   Threads used by --parallel-traversal (default: hardware threads)" << std::endl
+#ifndef _WIN32
+              << "  --dirfd                   Keep directories open and open files relative to them, not with --reader ifstream" << std::endl
+#endif
+#ifdef __linux__
+              << "  --readdir                 With --dirfd, list directories with readdir instead of getdents64" << std::endl
+#endif
+              << "  --threads <n>             Fixed number of thread pool workers (default: adaptive)" << std::endl
+              << "  --min-threads <n>         Smallest adaptive thread pool (default: 4)" << std::endl
+              << "  --max-threads <n>         Largest adaptive thread pool (default: 256)" << std::endl
+              << "  --batch-size <n>          Files handed to a worker at a time (default: 64)" << std::endl
+              << "  --engine <threads|uring>  Hydrate with blocking reads on a thread pool or through io_uring (default: threads)" << std::endl
+              << "  --uring-depth <n>         Files in flight per io_uring thread (default: 256)" << std::endl
+              << "  --uring-threads <n>       Threads driving an io_uring each (default: 2)" << std::endl
+#ifndef _WIN32
+              << "  --reader <posix|ifstream> How the thread pool reads files (default: posix)" << std::endl
+#endif
+              << "  --hydrate <mode>          Read the head, the tail, one byte per stride or the full file (default: head)" << std::endl
+              << "  --hydrate-bytes <n>       Bytes read by head and tail (default: 1024)" << std::endl
+              << "  --hydrate-stride <n>      Distance between the bytes read by stride (default: 4194304)" << std::endl
+              << "  --read-buffer <n>         Buffer the full read streams each file through (default: 1048576)" << std::endl
+#ifndef _WIN32
+              << "  --direct                  With --hydrate full, read with O_DIRECT, bypassing the page cache" << std::endl
+              << "  --drop-cache              Drop the pages of every file from the page cache once it has been read" << std::endl
+#endif
+#ifdef _WIN32
+              << "  --skip-resident attributes  Skip files without cloud placeholder attributes" << std::endl
+#else
+              << "  --skip-resident <blocks|holes>  Skip files whose blocks cover their size, with holes also check SEEK_HOLE" << std::endl
+#endif
+#ifndef _WIN32
+              << "  --state-file <path>       Remember hydrated files and skip them next run if unchanged" << std::endl
+#endif
+              << "  --snapshot-file <path>    Remember directories and skip unchanged, fully hydrated ones next run" << std::endl
+              << "  --queue <lockfree|mutex>  File queue implementation (default: lockfree)" << std::endl
+              << "  --queue-capacity <n>      Maximum number of files waiting for a worker (default: 65536)" << std::endl;
 }
 
 // Main function: Entry point of the program.
 int main(int argc, char* argv[]) {
     std::locale::global(std::locale(""));
-    if (argc < 2 || argc > 3) {
-        std::cerr << "Usage: " << argv[0] << " <DropboxFolderPath> [debug]" << std::endl;
+    fs::path dropbox_path;
+    Options options;
+    if (!parseArguments(argc, argv, dropbox_path, options)) {
+        printUsage(argv[0]);
         return 1;
     }
 
-    fs::path dropbox_path = argv[1];
-    bool debug = (argc == 3 && std::string(argv[2]) == "debug");
-
     if (!fs::exists(dropbox_path) || !fs::is_directory(dropbox_path)) {
         std::cerr << "Invalid directory path: " << dropbox_path << std::endl;
         return 1;
     }
 
+    int exit_code = 0;
     try {
-        startDirectoryTraversal(dropbox_path, debug);
+        logger.start(options.log_level, options.log_file);
+        startDirectoryTraversal(dropbox_path, options);
     }
     catch (const fs::filesystem_error& e) {
-        std::cerr << "Filesystem error: " << e.what() << std::endl;
-        return 1;
+        logger.log(LogLevel::Error, "Filesystem error: ", e.what());
+        exit_code = 1;
     }
     catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
+        logger.log(LogLevel::Error, "Error: ", e.what());
+        exit_code = 1;
     }
 
-    return 0;
+    logger.stop();
+    return exit_code;
 }
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Logger.h"
+#include "Progress.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Whether all files of a directory were hydrated in this run, kept by the directory snapshot.
+struct DirectoryOutcome {
+    std::atomic<bool> complete{ true };
+};
+
+// A directory whose files are queued. With the dirfd traversal it holds an open descriptor,
+// so workers can open the files relative to it instead of having the kernel resolve the full
+// path again. The descriptor is closed when the last batch that refers to it is done.
+struct Directory {
+    explicit Directory(std::filesystem::path directory_path, int directory_fd = -1) : path(std::move(directory_path)), fd(directory_fd) {}
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+
+    ~Directory() {
+#ifndef _WIN32
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    // Function to note that one of the directory's files could not be hydrated.
+    void markIncomplete() const {
+        if (outcome != nullptr) {
+            outcome->complete.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    const std::filesystem::path path;
+    const int fd;
+
+    // Set by the traversal before the first batch of the directory is queued, when a
+    // directory snapshot is written.
+    mutable DirectoryOutcome* outcome = nullptr;
+    // The outcome of the parent directory, set when the parent is recorded in the snapshot.
+    mutable DirectoryOutcome* parent_outcome = nullptr;
+};
+
+using DirectoryPtr = std::shared_ptr<const Directory>;
+
+// Name of a queued file relative to its directory, NUL-terminated. Points into the batch
+// that holds the file and is valid as long as the batch is.
+using FileName = const std::filesystem::path::value_type*;
+
+// A queued file in a log record. The directory and the name are only joined when the record
+// is formatted, straight into the logger's per-thread line, so logging a file does not allocate.
+struct QueuedFilePath {
+    void appendTo(std::string& line) const {
+        const auto& directory_path = directory.path.native();
+        appendPathText(line, directory_path.c_str(), directory_path.size());
+        if (!directory_path.empty() && !isSeparator(directory_path.back())) {
+            line += static_cast<char>(std::filesystem::path::preferred_separator);
+        }
+        appendPathText(line, name, std::char_traits<std::filesystem::path::value_type>::length(name));
+    }
+
+    static bool isSeparator(std::filesystem::path::value_type c) {
+#ifdef _WIN32
+        return c == L'\\' || c == L'/';
+#else
+        return c == '/';
+#endif
+    }
+
+    const Directory& directory;
+    FileName name;
+};
+
+// Files of one directory that cross the queue together, so the synchronization and wakeups
+// are paid once per batch. The directory is shared by all batches of the directory, and the
+// names are packed back to back into one buffer, each followed by a NUL, so a batch takes two
+// allocations whatever its size and a pending file costs a 4 byte offset plus its name.
+struct FileBatch {
+    using Char = std::filesystem::path::value_type;
+
+    size_t size() const {
+        return offsets.size();
+    }
+
+    FileName name(size_t index) const {
+        return characters.data() + offsets[index];
+    }
+
+    DirectoryPtr directory;
+    std::vector<Char> characters;
+    std::vector<uint32_t> offsets;
+};
+
+// Collects the files of one directory and hands them to the queue in batches of up to
+// batch_size, counting them as discovered if a progress is given.
+template <typename Queue>
+class BatchWriter {
+public:
+    BatchWriter(Queue& files, size_t batch_size, DirectoryPtr directory, Progress* progress = nullptr)
+        : files_(files), batch_size_(batch_size), directory_(std::move(directory)), progress_(progress) {}
+
+    void add(const std::filesystem::path::string_type& name) {
+        add(name.c_str(), name.size());
+    }
+
+    void add(FileName name) {
+        add(name, std::char_traits<FileBatch::Char>::length(name));
+    }
+
+    void add(FileName name, size_t length) {
+        if (batch_.offsets.empty()) {
+            batch_.offsets.reserve(batch_size_);
+            batch_.characters.reserve(batch_size_ * kReservedNameLength);
+        }
+        batch_.offsets.push_back(static_cast<uint32_t>(batch_.characters.size()));
+        batch_.characters.insert(batch_.characters.end(), name, name + length + 1);
+        if (batch_.offsets.size() >= batch_size_) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (!batch_.offsets.empty()) {
+            if (progress_ != nullptr) {
+                progress_->addDiscovered(batch_.offsets.size());
+            }
+            batch_.directory = directory_;
+            // A batch is sized for batch_size files when it is started. The last batch of a
+            // directory is often much smaller, and waits in the queue at its size instead.
+            if (batch_.offsets.capacity() > 2 * batch_.offsets.size()) {
+                batch_.offsets.shrink_to_fit();
+            }
+            if (batch_.characters.capacity() > 2 * batch_.characters.size()) {
+                batch_.characters.shrink_to_fit();
+            }
+            files_.push(std::move(batch_));
+            batch_ = FileBatch();
+        }
+    }
+
+private:
+    // Typical length of a file name including its NUL, to size the buffer of a new batch.
+    static constexpr size_t kReservedNameLength = 32;
+
+    Queue& files_;
+    size_t batch_size_;
+    DirectoryPtr directory_;
+    Progress* progress_;
+    FileBatch batch_;
+};
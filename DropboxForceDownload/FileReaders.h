@@ -0,0 +1,391 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Options.h"
+
+// Alignment of read buffers and full-read chunks. O_DIRECT needs the buffer, the offset and
+// the length of every read aligned to the logical block size, a page covers the usual ones.
+constexpr size_t kReadAlignment = 4096;
+
+// Page-aligned memory that grows on demand and is reused for every file.
+class AlignedBuffer {
+public:
+    AlignedBuffer() = default;
+
+    explicit AlignedBuffer(size_t size) {
+        reserve(size);
+    }
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    ~AlignedBuffer() {
+        release();
+    }
+
+    // Function to grow the buffer to at least size bytes. The contents are not kept.
+    void reserve(size_t size) {
+        if (size <= size_) {
+            return;
+        }
+        release();
+        size = (size + kReadAlignment - 1) / kReadAlignment * kReadAlignment;
+        data_ = static_cast<char*>(::operator new(size, std::align_val_t(kReadAlignment)));
+        size_ = size;
+    }
+
+    char* data() const {
+        return data_;
+    }
+
+private:
+    void release() {
+        if (data_ != nullptr) {
+            ::operator delete(data_, std::align_val_t(kReadAlignment));
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// The reads that hydrate one file with the configured Hydration. A reader asks for the first
+// read and, after each read, for the next one until there is none. Every mode sizes its own
+// buffer: the head or the tail, a single byte per stride, or large page-aligned chunks for the
+// full read, which is also the only mode that uses O_DIRECT.
+class HydrationPlan {
+public:
+    struct Read {
+        uint64_t offset = 0;
+        size_t length = 0;
+    };
+
+    explicit HydrationPlan(const Options& options = Options())
+        : mode_(options.hydration), bytes_(options.hydration_bytes), stride_(options.hydration_stride),
+          chunk_((options.read_buffer_size + kReadAlignment - 1) / kReadAlignment * kReadAlignment), direct_(options.direct_io),
+          drop_cache_(options.drop_cache) {}
+
+    Hydration mode() const {
+        return mode_;
+    }
+
+    // Whether the file is read from start to end, and the system should be told so.
+    bool sequential() const {
+        return mode_ == Hydration::Full;
+    }
+
+    // Whether the file is opened with O_DIRECT.
+    bool direct() const {
+        return direct_ && mode_ == Hydration::Full;
+    }
+
+    // Whether the pages of a file are dropped from the page cache once it has been read.
+    bool dropCache() const {
+        return drop_cache_;
+    }
+
+    // Whether the reads depend on the size of the file, which the reader then has to look up.
+    bool needsSize() const {
+        return mode_ == Hydration::Tail || mode_ == Hydration::Stride || direct();
+    }
+
+    size_t bufferSize() const {
+        switch (mode_) {
+        case Hydration::Stride:
+            return 1;
+        case Hydration::Full:
+            return chunk_;
+        default:
+            return bytes_;
+        }
+    }
+
+    // Function to get the first read of a file of the given size. Returns false if there is none.
+    bool first(uint64_t size, Read& read) const {
+        switch (mode_) {
+        case Hydration::Tail:
+            read = Read{ size > bytes_ ? size - bytes_ : 0, bytes_ };
+            return true;
+        case Hydration::Stride:
+            read = Read{ 0, 1 };
+            return size > 0;
+        default:
+            read = Read{ 0, bufferSize() };
+            return true;
+        }
+    }
+
+    // Function to get the read after one that returned result bytes. Returns false when the
+    // file is done. The full read goes on until a read returns nothing, since network and FUSE
+    // file systems may return less than asked for before the end. With O_DIRECT it stops at
+    // the size of the file instead, so it never reads at the unaligned offset of the end. A
+    // reader that could not get the size passes 0 and reads until a read returns nothing.
+    bool next(uint64_t size, Read& read, size_t result) const {
+        switch (mode_) {
+        case Hydration::Stride:
+            read.offset += stride_;
+            return read.offset < size;
+        case Hydration::Full:
+            read.offset += result;
+            return result > 0 && (!direct() || size == 0 || read.offset < size);
+        default:
+            return false;
+        }
+    }
+
+private:
+    Hydration mode_;
+    size_t bytes_;
+    size_t stride_;
+    size_t chunk_;
+    bool direct_;
+    bool drop_cache_;
+};
+
+// Function to get this thread's read buffer, grown to at least size bytes and then reused.
+inline char* readBuffer(size_t size) {
+    static thread_local AlignedBuffer buffer;
+    buffer.reserve(size);
+    return buffer.data();
+}
+
+// When a reader started and how long it spent opening, reading and closing the file, filled
+// in when asked for.
+struct ReadTimings {
+    uint64_t start_ns = 0;
+    uint64_t open_ns = 0;
+    uint64_t read_ns = 0;
+    uint64_t close_ns = 0;
+};
+
+// Function to read a monotonic clock in nanoseconds, for timing single system calls.
+inline uint64_t monotonicNanoseconds() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Results of a reader that did not hydrate a file, with errno saying why.
+constexpr long long kUnableToOpen = -1;
+constexpr long long kUnableToRead = -2;
+
+// Reads a file through std::ifstream as the plan says. Returns the number of bytes read,
+// kUnableToOpen if the file cannot be opened or kUnableToRead if a read fails. The readers
+// time the open, the reads and the close if timings are given.
+inline long long readFileWithStream(const std::filesystem::path& file_path, const HydrationPlan& plan, ReadTimings* timings = nullptr) {
+    uint64_t start = timings != nullptr ? monotonicNanoseconds() : 0;
+    std::ifstream file;
+    // The full read is unbuffered, so the chunks go straight into the large buffer instead of
+    // being copied through the small one of the stream.
+    if (plan.sequential()) {
+        file.rdbuf()->pubsetbuf(nullptr, 0);
+    }
+    file.open(file_path, std::ios::binary);
+    uint64_t opened = timings != nullptr ? monotonicNanoseconds() : 0;
+    if (timings != nullptr) {
+        timings->start_ns = start;
+        timings->open_ns = opened - start;
+    }
+    if (!file.is_open()) {
+        return kUnableToOpen;
+    }
+    char* buffer = readBuffer(plan.bufferSize());
+    uint64_t size = 0;
+    uint64_t position = 0;
+    if (plan.needsSize()) {
+        file.seekg(0, std::ios::end);
+        std::streamoff end = file.tellg();
+        size = position = end > 0 ? static_cast<uint64_t>(end) : 0;
+    }
+    long long bytes = 0;
+    errno = 0;
+    HydrationPlan::Read read;
+    bool more = plan.first(size, read);
+    while (more) {
+        // Sequential reads do not seek, a seek would drop the buffer of the stream.
+        if (read.offset != position) {
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(read.offset));
+        }
+        file.read(buffer, static_cast<std::streamsize>(read.length));
+        // The end of the file only sets eofbit and failbit, a failed read also sets badbit.
+        if (file.bad()) {
+            bytes = kUnableToRead;
+            break;
+        }
+        size_t result = static_cast<size_t>(file.gcount());
+        bytes += static_cast<long long>(result);
+        position = read.offset + result;
+        more = plan.next(size, read, result);
+    }
+    if (timings != nullptr) {
+        uint64_t done = monotonicNanoseconds();
+        timings->read_ns = done - opened;
+        file.close();
+        timings->close_ns = monotonicNanoseconds() - done;
+    }
+    if (bytes == kUnableToRead && errno == 0) {
+        errno = EIO;
+    }
+    return bytes;
+}
+
+#ifndef _WIN32
+// Function to open a file with O_NOATIME, which keeps the read from dirtying the inode. It is
+// only allowed for the owner of the file, so the open is retried without it on EPERM.
+inline int openWithoutAccessTime(int directory_fd, const char* name, int flags) {
+#ifdef O_NOATIME
+    int fd = openat(directory_fd, name, flags | O_NOATIME);
+    if (fd < 0 && errno == EPERM) {
+        fd = openat(directory_fd, name, flags);
+    }
+    return fd;
+#else
+    return openat(directory_fd, name, flags);
+#endif
+}
+
+// Function to open a file for reading relative to directory_fd, without updating its access
+// time. O_DIRECT is dropped again on file systems that refuse it with EINVAL.
+inline int openForReading(int directory_fd, const char* name, bool direct) {
+    int flags = O_RDONLY | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (direct) {
+        int fd = openWithoutAccessTime(directory_fd, name, flags | O_DIRECT);
+        if (fd >= 0 || errno != EINVAL) {
+            return fd;
+        }
+    }
+#else
+    (void)direct;
+#endif
+    return openWithoutAccessTime(directory_fd, name, flags);
+}
+
+// Function to tell the kernel a file is about to be read from start to end, so it reads ahead
+// further than by default.
+inline void adviseSequential(int fd) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+    (void)fd;
+#endif
+}
+
+// Function to drop the pages of a file that has been read from the page cache. Pages that were
+// only read are clean, so the kernel frees them right away.
+inline void dropCachedPages(int fd) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+#endif
+}
+
+#ifdef __linux__
+// Function to read the size of the page cache of the whole system, the Cached line of
+// /proc/meminfo. Returns false if it is not available.
+inline bool readPageCacheSize(uint64_t& bytes) {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    uint64_t kilobytes = 0;
+    std::string unit;
+    while (meminfo >> key >> kilobytes >> unit) {
+        if (key == "Cached:") {
+            bytes = kilobytes * 1024;
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+// Reads a file as the plan says with openat and pread into a buffer that is reused by the
+// thread. The name is resolved relative to directory_fd, pass AT_FDCWD for a full path. This
+// skips the locale setup, filebuf allocation and copying of std::ifstream. A full read through
+// the page cache is announced with POSIX_FADV_SEQUENTIAL, and before a chunk is read the one
+// after it is requested with readahead, so the disk or the provider already works on it while
+// the current chunk is copied. With dropCache, the pages of a file that was read without an error are dropped
+// before it is closed. Returns the number of bytes read, kUnableToOpen or kUnableToRead.
+inline long long readFileAt(int directory_fd, const char* name, const HydrationPlan& plan, ReadTimings* timings = nullptr) {
+    uint64_t start = timings != nullptr ? monotonicNanoseconds() : 0;
+    int fd = openForReading(directory_fd, name, plan.direct());
+    uint64_t opened = timings != nullptr ? monotonicNanoseconds() : 0;
+    if (timings != nullptr) {
+        timings->start_ns = start;
+        timings->open_ns = opened - start;
+    }
+    if (fd < 0) {
+        return kUnableToOpen;
+    }
+    char* buffer = readBuffer(plan.bufferSize());
+    uint64_t size = 0;
+    long long bytes = 0;
+    int error = 0;
+    struct stat status;
+    if (plan.needsSize()) {
+        if (fstat(fd, &status) == 0) {
+            size = static_cast<uint64_t>(status.st_size);
+        }
+        // Without the size, O_DIRECT would read at the unaligned end and fail there anyway.
+        else if (plan.direct()) {
+            error = errno;
+        }
+    }
+    bool cached = plan.sequential() && !plan.direct();
+    if (cached) {
+        adviseSequential(fd);
+    }
+    HydrationPlan::Read read;
+    bool more = error == 0 && plan.first(size, read);
+    while (more) {
+#ifdef __linux__
+        if (cached) {
+            readahead(fd, static_cast<off64_t>(read.offset + read.length), read.length);
+        }
+#endif
+        ssize_t result;
+        while ((result = pread(fd, buffer, read.length, static_cast<off_t>(read.offset))) < 0 && errno == EINTR) {
+        }
+        if (result < 0) {
+            error = errno;
+            break;
+        }
+        bytes += result;
+        more = plan.next(size, read, static_cast<size_t>(result));
+    }
+    uint64_t done = timings != nullptr ? monotonicNanoseconds() : 0;
+    if (plan.dropCache() && error == 0) {
+        dropCachedPages(fd);
+    }
+    close(fd);
+    if (timings != nullptr) {
+        timings->read_ns = done - opened;
+        timings->close_ns = monotonicNanoseconds() - done;
+    }
+    if (error != 0) {
+        errno = error;
+        return kUnableToRead;
+    }
+    return bytes;
+}
+
+// Reads a file with open and pread, see readFileAt.
+inline long long readFileWithPosix(const std::filesystem::path& file_path, const HydrationPlan& plan, ReadTimings* timings = nullptr) {
+    return readFileAt(AT_FDCWD, file_path.c_str(), plan, timings);
+}
+#endif
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <type_traits>
+
+#include "FileBatch.h"
+#include "FileReaders.h"
+#include "Logger.h"
+#include "Options.h"
+#include "ProviderSimulator.h"
+#include "RunContext.h"
+#include "Traversal.h"
+
+// The operations the pipeline performs on the file system: opening the root, listing a
+// directory and reading a file to hydrate it. Every implementation is a plain class with the same members,
+//
+//   static constexpr const char* kName;
+//   static constexpr bool kUring;       // files are hydrated by io_uring workers
+//   DirectoryPtr openRoot(const std::filesystem::path& path) const;
+//   template <typename Queue, typename OnDirectory>
+//   void list(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) const;
+//   long long readFile(const Directory& directory, FileName name, ReadTimings* timings) const;
+//
+// and the traversal and the workers are templates over it. The implementation is picked once
+// at startup by withFileSystemOps, so every call in the hot loop is resolved at compile time.
+// readFile returns the number of bytes read, or kUnableToOpen or kUnableToRead with errno set.
+
+// std::filesystem listing and std::ifstream reads, available everywhere.
+class StdFilesystemOps {
+public:
+    static constexpr const char* kName = "std::filesystem";
+    static constexpr bool kUring = false;
+
+    explicit StdFilesystemOps(const Options& options) : plan_(options) {}
+
+    DirectoryPtr openRoot(const std::filesystem::path& path) const {
+        return std::make_shared<const Directory>(path);
+    }
+
+    template <typename Queue, typename OnDirectory>
+    void list(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) const {
+        enumerateDirectoryWithIterator(directory, files, context, on_directory);
+    }
+
+    long long readFile(const Directory& directory, FileName name, ReadTimings* timings) const {
+        return readFileWithStream(directory.path / name, plan_, timings);
+    }
+
+private:
+    HydrationPlan plan_;
+};
+
+#ifndef _WIN32
+// POSIX system calls. With dirfd every directory keeps a descriptor, it is listed with
+// getdents64 or readdir and its files are opened relative to it; without, directories are
+// listed with std::filesystem and files opened by their full path.
+class PosixOps {
+public:
+    static constexpr const char* kName = "posix";
+    static constexpr bool kUring = false;
+
+    explicit PosixOps(const Options& options) : dirfd_(options.dirfd), getdents_(options.getdents), plan_(options) {}
+
+    DirectoryPtr openRoot(const std::filesystem::path& path) const {
+        return dirfd_ ? openDirectory(path) : std::make_shared<const Directory>(path);
+    }
+
+    template <typename Queue, typename OnDirectory>
+    void list(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) const {
+        if (directory->fd < 0) {
+            enumerateDirectoryWithIterator(directory, files, context, on_directory);
+            return;
+        }
+#ifdef __linux__
+        if (getdents_) {
+            enumerateDirectoryGetdents(directory, files, context, on_directory);
+            return;
+        }
+#endif
+        enumerateDirectoryAt(directory, files, context, on_directory);
+    }
+
+    long long readFile(const Directory& directory, FileName name, ReadTimings* timings) const {
+        if (directory.fd >= 0) {
+            return readFileAt(directory.fd, name, plan_, timings);
+        }
+        return readFileWithPosix(directory.path / name, plan_, timings);
+    }
+
+private:
+    bool dirfd_;
+    bool getdents_;
+    HydrationPlan plan_;
+};
+#endif
+
+#ifdef __linux__
+// io_uring: directories are handled like PosixOps, files are hydrated by io_uring workers
+// with many opens in flight. readFile is only used by a worker whose ring cannot be created.
+class UringOps : public PosixOps {
+public:
+    static constexpr const char* kName = "io_uring";
+    static constexpr bool kUring = true;
+
+    using PosixOps::PosixOps;
+};
+#endif
+
+// Wraps other operations with the simulated sync provider: listing a directory and opening a
+// file first wait like the provider would. The wait counts as part of the open. The simulator
+// blocks the calling thread, so it always hydrates on worker threads, never on io_uring.
+template <typename Base>
+class SimulatedOps {
+public:
+    static constexpr const char* kName = Base::kName;
+    static constexpr bool kUring = false;
+
+    SimulatedOps(const Base& base, ProviderSimulator& simulator) : base_(base), simulator_(&simulator) {}
+
+    DirectoryPtr openRoot(const std::filesystem::path& path) const {
+        return base_.openRoot(path);
+    }
+
+    template <typename Queue, typename OnDirectory>
+    void list(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) const {
+        simulator_->list(*directory);
+        base_.list(directory, files, context, on_directory);
+    }
+
+    long long readFile(const Directory& directory, FileName name, ReadTimings* timings) const {
+        uint64_t start = timings != nullptr ? monotonicNanoseconds() : 0;
+        int error = simulator_->hydrate(directory, name);
+        if (error != 0) {
+            if (timings != nullptr) {
+                *timings = ReadTimings{ start, monotonicNanoseconds() - start, 0, 0 };
+            }
+            errno = error;
+            return kUnableToOpen;
+        }
+        long long bytes = base_.readFile(directory, name, timings);
+        if (timings != nullptr) {
+            timings->open_ns += timings->start_ns - start;
+            timings->start_ns = start;
+        }
+        return bytes;
+    }
+
+private:
+    const Base& base_;
+    ProviderSimulator* simulator_;
+};
+
+// Function to pick the file system operations for the options and call run with them. Each
+// implementation instantiates its own copy of the pipeline.
+template <typename Run>
+void withFileSystemOps(const Options& options, ProviderSimulator* simulator, Run run) {
+    auto start = [&](const auto& ops) {
+        using Ops = std::decay_t<decltype(ops)>;
+        // The caller does not combine the simulator with io_uring.
+        if constexpr (!Ops::kUring) {
+            if (simulator != nullptr) {
+                logger.log(LogLevel::Info, "File system: ", Ops::kName, ", simulated provider");
+                run(SimulatedOps<Ops>(ops, *simulator));
+                return;
+            }
+        }
+        logger.log(LogLevel::Info, "File system: ", Ops::kName);
+        run(ops);
+    };
+#ifdef __linux__
+    if (options.engine == Engine::Uring) {
+        start(UringOps(options));
+        return;
+    }
+#endif
+#ifndef _WIN32
+    if (options.dirfd || options.reader == Reader::Posix) {
+        start(PosixOps(options));
+        return;
+    }
+#endif
+    start(StdFilesystemOps(options));
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+#include <vector>
+
+// Identity of a file's content as seen by stat. A file whose identity matches the one
+// recorded after its last successful hydration has not changed since.
+struct FileIdentity {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    static FileIdentity fromStat(const struct stat& status) {
+        FileIdentity identity;
+        identity.device = static_cast<uint64_t>(status.st_dev);
+        identity.inode = static_cast<uint64_t>(status.st_ino);
+        identity.size = static_cast<uint64_t>(status.st_size);
+#ifdef __APPLE__
+        identity.mtime_ns = static_cast<int64_t>(status.st_mtimespec.tv_sec) * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+        identity.mtime_ns = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+        return identity;
+    }
+};
+
+// On-disk record of the files that were hydrated successfully, so later runs can skip
+// unchanged files without opening them. The file is an open-addressing hash table keyed by
+// (device, inode) that is memory-mapped and shared by all workers: lookups and inserts are
+// plain atomic loads, stores and a compare-and-swap on the key, without any lock. The table
+// is sized when it is opened, a table that got more than half full is rebuilt at twice the
+// size on the next run, and inserts stop if it fills up during a run.
+class HydrationState {
+public:
+    explicit HydrationState(const std::filesystem::path& file_path, uint64_t min_capacity = uint64_t(1) << 20) {
+        fd_ = open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "Unable to open state file " + file_path.string());
+        }
+        try {
+            load(file_path, min_capacity);
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    HydrationState(const HydrationState&) = delete;
+    HydrationState& operator=(const HydrationState&) = delete;
+
+    ~HydrationState() {
+        release();
+    }
+
+    // True if the file was hydrated in an earlier run and has not changed since.
+    bool contains(const FileIdentity& identity) const {
+        uint64_t key = keyOf(identity);
+        for (uint64_t probe = 0, index = key & mask_; probe < kMaxProbes; ++probe, index = (index + 1) & mask_) {
+            const Entry& entry = entries_[index];
+            uint64_t entry_key = __atomic_load_n(&entry.key, __ATOMIC_ACQUIRE);
+            if (entry_key == 0) {
+                return false;
+            }
+            if (entry_key == key) {
+                return __atomic_load_n(&entry.size, __ATOMIC_RELAXED) == identity.size && __atomic_load_n(&entry.mtime_ns, __ATOMIC_RELAXED) == identity.mtime_ns;
+            }
+        }
+        return false;
+    }
+
+    // Records a successful hydration, replacing what was recorded for the same file before.
+    void record(const FileIdentity& identity) {
+        if (__atomic_load_n(&header_->count, __ATOMIC_RELAXED) >= header_->capacity / 10 * 9) {
+            return;
+        }
+        uint64_t key = keyOf(identity);
+        for (uint64_t probe = 0, index = key & mask_; probe < kMaxProbes; ++probe, index = (index + 1) & mask_) {
+            Entry& entry = entries_[index];
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&entry.key, &expected, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_add(&header_->count, 1, __ATOMIC_RELAXED);
+            }
+            else if (expected != key) {
+                continue;
+            }
+            __atomic_store_n(&entry.size, identity.size, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry.mtime_ns, identity.mtime_ns, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    // Number of files recorded.
+    uint64_t size() const {
+        return __atomic_load_n(&header_->count, __ATOMIC_RELAXED);
+    }
+
+private:
+    static constexpr char kMagic[8] = { 'D', 'F', 'D', 'S', 'T', 'A', 'T', 'E' };
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint64_t kMaxProbes = 4096;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+        uint64_t capacity;
+        uint64_t count;
+    };
+
+    // A key of zero marks an empty slot.
+    struct Entry {
+        uint64_t key;
+        uint64_t size;
+        int64_t mtime_ns;
+    };
+
+    static uint64_t keyOf(const FileIdentity& identity) {
+        // splitmix64 finalizer over device and inode.
+        uint64_t x = identity.inode ^ (identity.device * 0x9E3779B97F4A7C15ull);
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        x ^= x >> 31;
+        return x == 0 ? 1 : x;
+    }
+
+    static uint64_t roundUpToPowerOfTwo(uint64_t value) {
+        uint64_t result = 1024;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    static uint64_t fileSize(uint64_t capacity) {
+        return sizeof(Header) + capacity * sizeof(Entry);
+    }
+
+    void load(const std::filesystem::path& file_path, uint64_t min_capacity) {
+        struct stat status;
+        if (fstat(fd_, &status) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Unable to read state file " + file_path.string());
+        }
+
+        // Keep the entries of a valid existing table and rebuild it if it is too small.
+        std::vector<Entry> existing;
+        uint64_t capacity = roundUpToPowerOfTwo(min_capacity);
+        Header header{};
+        if (static_cast<uint64_t>(status.st_size) >= sizeof(Header) && pread(fd_, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+            std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 && header.version == kVersion && header.entry_size == sizeof(Entry) &&
+            header.capacity != 0 && (header.capacity & (header.capacity - 1)) == 0 && static_cast<uint64_t>(status.st_size) == fileSize(header.capacity)) {
+            if (header.count * 2 <= header.capacity && header.capacity >= capacity) {
+                map(header.capacity);
+                return;
+            }
+            map(header.capacity);
+            for (uint64_t i = 0; i < header.capacity; ++i) {
+                if (entries_[i].key != 0) {
+                    existing.push_back(entries_[i]);
+                }
+            }
+            unmap();
+            capacity = roundUpToPowerOfTwo(std::max<uint64_t>(capacity, existing.size() * 4));
+        }
+        else if (status.st_size != 0) {
+            // Never overwrite a file that is not a state file.
+            throw std::system_error(EINVAL, std::generic_category(), "Not a state file: " + file_path.string());
+        }
+
+        // Start a new table. ftruncate fills it with zeros, which are empty slots.
+        if (ftruncate(fd_, 0) != 0 || ftruncate(fd_, static_cast<off_t>(fileSize(capacity))) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Unable to resize state file " + file_path.string());
+        }
+        map(capacity);
+        std::memcpy(header_->magic, kMagic, sizeof(kMagic));
+        header_->version = kVersion;
+        header_->entry_size = sizeof(Entry);
+        header_->capacity = capacity;
+        header_->count = 0;
+        for (const Entry& entry : existing) {
+            for (uint64_t index = entry.key & mask_;; index = (index + 1) & mask_) {
+                if (entries_[index].key == 0) {
+                    entries_[index] = entry;
+                    ++header_->count;
+                    break;
+                }
+            }
+        }
+    }
+
+    void map(uint64_t capacity) {
+        mapped_size_ = fileSize(capacity);
+        void* address = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (address == MAP_FAILED) {
+            mapped_size_ = 0;
+            throw std::system_error(errno, std::generic_category(), "Unable to map state file");
+        }
+        header_ = static_cast<Header*>(address);
+        entries_ = reinterpret_cast<Entry*>(static_cast<char*>(address) + sizeof(Header));
+        mask_ = capacity - 1;
+    }
+
+    void unmap() {
+        if (header_ != nullptr) {
+            munmap(header_, mapped_size_);
+            header_ = nullptr;
+            entries_ = nullptr;
+        }
+    }
+
+    void release() {
+        if (header_ != nullptr) {
+            msync(header_, mapped_size_, MS_SYNC);
+        }
+        unmap();
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_ = -1;
+    Header* header_ = nullptr;
+    Entry* entries_ = nullptr;
+    uint64_t mask_ = 0;
+    size_t mapped_size_ = 0;
+};
+
+#else
+
+// The state file is not available on Windows, where --skip-resident attributes recognizes
+// local files from their attributes without opening them. The class is complete, so the
+// pipeline can own an empty pointer to it.
+class HydrationState {};
+
+#endif
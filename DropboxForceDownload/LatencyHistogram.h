@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "PerThread.h"
+
+// Histogram of latencies in nanoseconds with logarithmic buckets, like HdrHistogram: every
+// power of two is split into 32 linear sub-buckets, so a value is known to within about 3%
+// from 64 ns to a minute in 8 KB. Longer latencies share the last bucket, the maximum is
+// kept exactly. Only one thread records into a histogram, others may read it at any time.
+class LatencyHistogram {
+public:
+    void record(uint64_t nanoseconds) {
+        addToOwnCounter(counts_[bucketIndex(nanoseconds)], 1);
+        addToOwnCounter(count_, 1);
+        addToOwnCounter(sum_, nanoseconds);
+        if (nanoseconds > max_.load(std::memory_order_relaxed)) {
+            max_.store(nanoseconds, std::memory_order_relaxed);
+        }
+    }
+
+    // Adds the values of another histogram, which may still be recorded into.
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < kBuckets; ++i) {
+            uint64_t count = other.counts_[i].load(std::memory_order_relaxed);
+            if (count != 0) {
+                addToOwnCounter(counts_[i], count);
+                addToOwnCounter(count_, count);
+            }
+        }
+        addToOwnCounter(sum_, other.sum_.load(std::memory_order_relaxed));
+        uint64_t other_max = other.max_.load(std::memory_order_relaxed);
+        if (other_max > max_.load(std::memory_order_relaxed)) {
+            max_.store(other_max, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    // Sum of all values, for the mean.
+    uint64_t sum() const {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    // Latency that the given percentage of the values does not exceed, as the upper end of
+    // its bucket. Returns 0 for an empty histogram.
+    uint64_t percentile(double percent) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(percent / 100.0 * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucketUpperBound(i), max());
+            }
+        }
+        return max();
+    }
+
+private:
+    static constexpr unsigned kSubBucketBits = 5;
+    static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+    static constexpr unsigned kMaxShift = 31;
+    static constexpr size_t kBuckets = (kMaxShift + 2) * kSubBuckets;
+
+    // Values below 64 have a bucket each. Above, a value with its highest bit at position e
+    // keeps its top 6 bits, the shift e - 5 selects the row and the bits the sub-bucket.
+    static size_t bucketIndex(uint64_t value) {
+        if (value < 2 * kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        unsigned shift = highestBit(value) - kSubBucketBits;
+        if (shift > kMaxShift) {
+            return kBuckets - 1;
+        }
+        return static_cast<size_t>(shift * kSubBuckets + (value >> shift));
+    }
+
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < 2 * kSubBuckets) {
+            return index;
+        }
+        unsigned shift = static_cast<unsigned>(index / kSubBuckets) - 1;
+        uint64_t mantissa = index % kSubBuckets + kSubBuckets;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    static unsigned highestBit(uint64_t value) {
+        unsigned bit = 0;
+        while (value >>= 1) {
+            ++bit;
+        }
+        return bit;
+    }
+
+    std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+    std::atomic<uint64_t> count_{ 0 };
+    std::atomic<uint64_t> sum_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
+
+// Open and read latencies of the hydrated files, recorded per thread and merged for the report.
+// Slow opens and reads point at the sync provider; a low file rate with fast opens and reads
+// means the workers were waiting for the traversal.
+class LatencyStats {
+public:
+    void recordOpen(uint64_t nanoseconds) {
+        histograms_.local().open.record(nanoseconds);
+    }
+
+    void recordRead(uint64_t nanoseconds) {
+        histograms_.local().read.record(nanoseconds);
+    }
+
+    void merge(LatencyHistogram& open, LatencyHistogram& read) const {
+        histograms_.forEach([&](const Histograms& histograms) {
+            open.merge(histograms.open);
+            read.merge(histograms.read);
+        });
+    }
+
+private:
+    struct Histograms {
+        LatencyHistogram open;
+        LatencyHistogram read;
+    };
+
+    PerThread<Histograms> histograms_;
+};
+
+// Function to format a latency with a unit that keeps it short.
+inline std::string formatLatency(uint64_t nanoseconds) {
+    char text[32];
+    if (nanoseconds < 1000) {
+        std::snprintf(text, sizeof(text), "%llu ns", static_cast<unsigned long long>(nanoseconds));
+    }
+    else if (nanoseconds < 1000000) {
+        std::snprintf(text, sizeof(text), "%.1f us", nanoseconds / 1e3);
+    }
+    else if (nanoseconds < 1000000000) {
+        std::snprintf(text, sizeof(text), "%.1f ms", nanoseconds / 1e6);
+    }
+    else {
+        std::snprintf(text, sizeof(text), "%.2f s", nanoseconds / 1e9);
+    }
+    return text;
+}
+
+// Function to summarize a histogram as its percentiles and maximum.
+inline std::string formatPercentiles(const LatencyHistogram& histogram) {
+    return "p50 " + formatLatency(histogram.percentile(50)) + ", p90 " + formatLatency(histogram.percentile(90)) + ", p99 " +
+           formatLatency(histogram.percentile(99)) + ", p99.9 " + formatLatency(histogram.percentile(99.9)) + ", max " +
+           formatLatency(histogram.max()) + " (" + std::to_string(histogram.count()) + " files)";
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Options.h"
+
+extern std::mutex console_mutex;
+
+// The status line the progress reporter keeps on standard error, empty while there is none.
+// Guarded by console_mutex. Console output clears it first and draws it again below.
+inline std::string status_line;
+
+// Function to clear the status line before writing to the console, with console_mutex held.
+inline void clearStatusLine() {
+    if (!status_line.empty()) {
+        std::cerr << '\r' << std::string(status_line.size(), ' ') << '\r';
+    }
+}
+
+// Function to draw the status line again after writing to the console, with console_mutex held.
+inline void redrawStatusLine() {
+    if (!status_line.empty()) {
+        std::cerr << status_line << std::flush;
+    }
+}
+
+// Function to append the text of a path to a log line without a temporary string. Windows
+// paths are UTF-16 and are written as UTF-8, so every name can be logged whatever the code page.
+inline void appendPathText(std::string& line, const std::filesystem::path::value_type* text, size_t length) {
+#ifdef _WIN32
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t code = static_cast<uint16_t>(text[i]);
+        if (code >= 0xD800 && code < 0xDC00 && i + 1 < length && text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (static_cast<uint16_t>(text[++i]) - 0xDC00);
+        }
+        if (code < 0x80) {
+            line += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            line += static_cast<char>(0xC0 | (code >> 6));
+            line += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000) {
+            line += static_cast<char>(0xE0 | (code >> 12));
+            line += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            line += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else {
+            line += static_cast<char>(0xF0 | (code >> 18));
+            line += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            line += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            line += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+#else
+    line.append(text, length);
+#endif
+}
+
+// Asynchronous log sink. Threads format a record into a per-thread string and copy it into
+// their own single-producer ring buffer with two relaxed loads and a release store, without
+// a lock or a system call. A logger thread drains all rings and writes what it found in one
+// large write per round, so workers never wait for the terminal. Records of one thread stay
+// in order, records of different threads may be reordered by up to one drain round. Errors
+// and warnings go to standard error and the rest to standard output, or everything to the
+// log file. Before start and after stop records are written directly.
+class Logger {
+public:
+    Logger() = default;
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    ~Logger() {
+        stop();
+    }
+
+    // Sets the level and the optional log file, and starts the logger thread.
+    void start(LogLevel level, const std::filesystem::path& file_path = {}) {
+        level_.store(level, std::memory_order_relaxed);
+        if (!file_path.empty()) {
+            file_.open(file_path, std::ios::binary | std::ios::trunc);
+            if (!file_) {
+                throw std::system_error(errno, std::generic_category(), "Unable to open log file " + file_path.string());
+            }
+        }
+        stopped_ = false;
+        thread_ = std::thread([this]() { run(); });
+        running_.store(true, std::memory_order_release);
+    }
+
+    // Writes every pending record and stops the logger thread.
+    void stop() {
+        if (!running_.exchange(false, std::memory_order_acq_rel)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        if (file_.is_open()) {
+            file_.close();
+        }
+    }
+
+    bool enabled(LogLevel level) const {
+        return level <= level_.load(std::memory_order_relaxed);
+    }
+
+    // Formats the arguments into one line and logs it if the level is enabled.
+    template <typename... Args>
+    void log(LogLevel level, const Args&... args) {
+        if (!enabled(level)) {
+            return;
+        }
+        static thread_local std::string line;
+        line.clear();
+        (append(line, args), ...);
+        line += '\n';
+        write(level, line.data(), line.size());
+    }
+
+private:
+    // Record layout in a ring: level, length, text.
+    static constexpr size_t kHeaderSize = 1 + sizeof(uint32_t);
+    static constexpr size_t kBufferSize = 64 * 1024;
+    static constexpr std::chrono::milliseconds kDrainInterval{ 20 };
+
+    struct Buffer {
+        alignas(64) std::atomic<size_t> head{ 0 };
+        alignas(64) std::atomic<size_t> tail{ 0 };
+        char data[kBufferSize];
+    };
+
+    static void append(std::string& line, const char* text) {
+        line += text;
+    }
+
+    static void append(std::string& line, const std::string& text) {
+        line += text;
+    }
+
+    static void append(std::string& line, const std::filesystem::path& path) {
+        appendPathText(line, path.c_str(), path.native().size());
+    }
+
+    // Values that format themselves, like the path of a queued file.
+    template <typename T>
+    static auto append(std::string& line, const T& value) -> decltype(value.appendTo(line)) {
+        value.appendTo(line);
+    }
+
+    template <typename T>
+    static std::enable_if_t<std::is_integral_v<T>> append(std::string& line, T value) {
+        line += std::to_string(value);
+    }
+
+    template <typename T>
+    static std::enable_if_t<std::is_floating_point_v<T>> append(std::string& line, T value) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.4g", static_cast<double>(value));
+        line += text;
+    }
+
+    // Function to find this thread's ring, registering it on first use.
+    Buffer& local() {
+        struct Cache {
+            const Logger* owner = nullptr;
+            Buffer* buffer = nullptr;
+        };
+        static thread_local Cache cache;
+        if (cache.owner != this) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffers_.push_back(std::make_unique<Buffer>());
+            cache.owner = this;
+            cache.buffer = buffers_.back().get();
+        }
+        return *cache.buffer;
+    }
+
+    void write(LogLevel level, const char* text, size_t length) {
+        // Records that do not fit a ring comfortably are written directly.
+        if (!running_.load(std::memory_order_acquire) || length + kHeaderSize > kBufferSize / 2) {
+            std::lock_guard<std::mutex> guard(console_mutex);
+            bool console = !file_.is_open();
+            if (console) {
+                clearStatusLine();
+            }
+            output(level).write(text, static_cast<std::streamsize>(length));
+            output(level).flush();
+            if (console) {
+                redrawStatusLine();
+            }
+            return;
+        }
+
+        Buffer& buffer = local();
+        size_t head = buffer.head.load(std::memory_order_relaxed);
+        size_t needed = length + kHeaderSize;
+        // A full ring waits for the logger thread, so no record is lost.
+        while (kBufferSize - (head - buffer.tail.load(std::memory_order_acquire)) < needed) {
+            wake_.notify_one();
+            std::this_thread::yield();
+        }
+        char header[kHeaderSize];
+        header[0] = static_cast<char>(level);
+        uint32_t record_length = static_cast<uint32_t>(length);
+        std::memcpy(header + 1, &record_length, sizeof(record_length));
+        copyIn(buffer, head, header, kHeaderSize);
+        copyIn(buffer, head + kHeaderSize, text, length);
+        buffer.head.store(head + needed, std::memory_order_release);
+        if (head + needed - buffer.tail.load(std::memory_order_relaxed) > kBufferSize / 2) {
+            wake_.notify_one();
+        }
+    }
+
+    static void copyIn(Buffer& buffer, size_t position, const char* source, size_t length) {
+        size_t offset = position % kBufferSize;
+        size_t first = std::min(length, kBufferSize - offset);
+        std::memcpy(buffer.data + offset, source, first);
+        std::memcpy(buffer.data, source + first, length - first);
+    }
+
+    static void copyOut(const Buffer& buffer, size_t position, char* destination, size_t length) {
+        size_t offset = position % kBufferSize;
+        size_t first = std::min(length, kBufferSize - offset);
+        std::memcpy(destination, buffer.data + offset, first);
+        std::memcpy(destination + first, buffer.data, length - first);
+    }
+
+    std::ostream& output(LogLevel level) {
+        if (file_.is_open()) {
+            return file_;
+        }
+        return level <= LogLevel::Warning ? std::cerr : std::cout;
+    }
+
+    // Moves the records of every ring into the output chunks. Returns false if there were none.
+    bool drain(std::string& standard_output, std::string& standard_error) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            drained_.clear();
+            for (const auto& buffer : buffers_) {
+                drained_.push_back(buffer.get());
+            }
+        }
+        bool found = false;
+        for (Buffer* buffer : drained_) {
+            size_t tail = buffer->tail.load(std::memory_order_relaxed);
+            size_t head = buffer->head.load(std::memory_order_acquire);
+            while (tail != head) {
+                char header[kHeaderSize];
+                copyOut(*buffer, tail, header, kHeaderSize);
+                uint32_t length = 0;
+                std::memcpy(&length, header + 1, sizeof(length));
+                std::string& chunk = file_.is_open() || static_cast<LogLevel>(header[0]) > LogLevel::Warning ? standard_output : standard_error;
+                size_t size = chunk.size();
+                chunk.resize(size + length);
+                copyOut(*buffer, tail + kHeaderSize, &chunk[size], length);
+                tail += kHeaderSize + length;
+                found = true;
+            }
+            buffer->tail.store(tail, std::memory_order_release);
+        }
+        return found;
+    }
+
+    void flushChunks(std::string& standard_output, std::string& standard_error) {
+        if (standard_output.empty() && standard_error.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(console_mutex);
+        bool console = !file_.is_open();
+        if (console) {
+            clearStatusLine();
+        }
+        std::ostream& out = file_.is_open() ? static_cast<std::ostream&>(file_) : std::cout;
+        out.write(standard_output.data(), static_cast<std::streamsize>(standard_output.size()));
+        out.flush();
+        std::cerr.write(standard_error.data(), static_cast<std::streamsize>(standard_error.size()));
+        std::cerr.flush();
+        if (console) {
+            redrawStatusLine();
+        }
+        standard_output.clear();
+        standard_error.clear();
+    }
+
+    void run() {
+        std::string standard_output;
+        std::string standard_error;
+        while (true) {
+            bool found = drain(standard_output, standard_error);
+            flushChunks(standard_output, standard_error);
+            if (found) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopped_) {
+                break;
+            }
+            wake_.wait_for(lock, kDrainInterval);
+        }
+        // Records written while stopping.
+        drain(standard_output, standard_error);
+        flushChunks(standard_output, standard_error);
+    }
+
+    std::atomic<LogLevel> level_{ LogLevel::Warning };
+    std::atomic<bool> running_{ false };
+    std::ofstream file_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopped_ = false;
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+    std::vector<Buffer*> drained_;
+    std::thread thread_;
+};
+
+// The process-wide logger, defined next to main.
+extern Logger logger;
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include "LatencyHistogram.h"
+#include "Logger.h"
+#include "Progress.h"
+
+// Values that only the pipeline knows, sampled whenever metrics are written.
+struct PipelineSample {
+    size_t queue_high_water_mark = 0;
+    size_t queue_capacity = 0;
+    size_t batch_size = 0;
+    unsigned threads = 0;
+};
+
+// Writes the metrics of a run to <prefix>.json and, for the node_exporter textfile collector,
+// <prefix>.prom: file counts, bytes, average rates, open and read latency percentiles, the
+// queue high-water mark, the thread count and errors by errno, of failed opens and reads and of
+// the traversal. Both files are written next to their destination and renamed over it, so a
+// collector never reads half a file. With an interval they are also rewritten every that many
+// seconds while the run goes on.
+class MetricsWriter {
+public:
+    using Sampler = std::function<PipelineSample()>;
+
+    MetricsWriter(const std::filesystem::path& prefix, unsigned interval_seconds, const std::filesystem::path& root, const Progress& progress,
+                  const LatencyStats* latency, Sampler sampler)
+        : prefix_(prefix), root_(pathText(root)), progress_(progress), latency_(latency), sampler_(std::move(sampler)), start_(Clock::now()) {
+        if (interval_seconds > 0) {
+            thread_ = std::thread([this, interval_seconds]() { run(std::chrono::seconds(interval_seconds)); });
+        }
+    }
+
+    MetricsWriter(const MetricsWriter&) = delete;
+    MetricsWriter& operator=(const MetricsWriter&) = delete;
+
+    ~MetricsWriter() {
+        stopThread();
+    }
+
+    // Stops the periodic writes and writes the final metrics. Throws std::system_error if they
+    // cannot be written.
+    void finish(bool success) {
+        stopThread();
+        write(true, success);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Everything that goes into one write, taken at the same moment.
+    struct Snapshot {
+        bool finished = false;
+        bool success = false;
+        double elapsed_seconds = 0;
+        double timestamp_seconds = 0;
+        ProgressTotals totals;
+        std::map<int, uint64_t> errors;
+        LatencyHistogram open;
+        LatencyHistogram read;
+        PipelineSample pipeline;
+    };
+
+    void stopThread() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        stop_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void run(std::chrono::seconds interval) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_.wait_for(lock, interval, [&]() { return stopped_; })) {
+            lock.unlock();
+            try {
+                write(false, true);
+            }
+            catch (const std::exception& e) {
+                logger.log(LogLevel::Warning, "Unable to write metrics: ", e.what());
+            }
+            lock.lock();
+        }
+    }
+
+    void write(bool finished, bool success) {
+        Snapshot snapshot;
+        snapshot.finished = finished;
+        snapshot.success = success;
+        snapshot.elapsed_seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+        snapshot.timestamp_seconds = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+        snapshot.totals = progress_.totals();
+        snapshot.errors = progress_.errors();
+        if (latency_ != nullptr) {
+            latency_->merge(snapshot.open, snapshot.read);
+        }
+        snapshot.pipeline = sampler_();
+
+        std::filesystem::path json_path = prefix_;
+        json_path += ".json";
+        std::filesystem::path prometheus_path = prefix_;
+        prometheus_path += ".prom";
+        replaceFile(json_path, formatJson(snapshot));
+        replaceFile(prometheus_path, formatPrometheus(snapshot));
+    }
+
+    static std::string pathText(const std::filesystem::path& path) {
+        std::string text;
+        appendPathText(text, path.c_str(), path.native().size());
+        return text;
+    }
+
+    static void replaceFile(const std::filesystem::path& file_path, const std::string& contents) {
+        std::filesystem::path temporary_path = file_path;
+        temporary_path += ".tmp";
+        {
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+            if (!file) {
+                throw std::system_error(errno, std::generic_category(), "Unable to write metrics file " + pathText(temporary_path));
+            }
+        }
+        std::filesystem::rename(temporary_path, file_path);
+    }
+
+    static std::string number(double value) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.6g", value);
+        return text;
+    }
+
+    static std::string timestamp(double seconds) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.3f", seconds);
+        return text;
+    }
+
+    static std::string escapeJson(const std::string& text) {
+        std::string result;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                result += escaped;
+            }
+            else {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    static std::string escapeLabel(const std::string& text) {
+        std::string result;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            }
+            else if (c == '\n') {
+                result += "\\n";
+            }
+            else {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    static double rate(double value, double seconds) {
+        return seconds > 0 ? value / seconds : 0;
+    }
+
+    static std::string jsonLatency(const LatencyHistogram& histogram) {
+        return "{\"count\": " + std::to_string(histogram.count()) + ", \"p50\": " + number(histogram.percentile(50) / 1e9) +
+               ", \"p90\": " + number(histogram.percentile(90) / 1e9) + ", \"p99\": " + number(histogram.percentile(99) / 1e9) +
+               ", \"p999\": " + number(histogram.percentile(99.9) / 1e9) + ", \"max\": " + number(histogram.max() / 1e9) + "}";
+    }
+
+    std::string formatJson(const Snapshot& snapshot) const {
+        const ProgressTotals& totals = snapshot.totals;
+        std::string json = "{\n";
+        json += "  \"root\": \"" + escapeJson(root_) + "\",\n";
+        json += "  \"finished\": " + std::string(snapshot.finished ? "true" : "false") + ",\n";
+        json += "  \"success\": " + std::string(snapshot.success ? "true" : "false") + ",\n";
+        json += "  \"timestamp_seconds\": " + timestamp(snapshot.timestamp_seconds) + ",\n";
+        json += "  \"elapsed_seconds\": " + number(snapshot.elapsed_seconds) + ",\n";
+        json += "  \"files\": {\"discovered\": " + std::to_string(totals.discovered) + ", \"hydrated\": " + std::to_string(totals.hydrated) +
+                ", \"skipped\": " + std::to_string(totals.skipped) + ", \"failed\": " + std::to_string(totals.failed) + "},\n";
+        json += "  \"bytes\": " + std::to_string(totals.bytes) + ",\n";
+        json += "  \"files_per_second\": " + number(rate(static_cast<double>(totals.done()), snapshot.elapsed_seconds)) + ",\n";
+        json += "  \"bytes_per_second\": " + number(rate(static_cast<double>(totals.bytes), snapshot.elapsed_seconds)) + ",\n";
+        json += "  \"latency_seconds\": {\"open\": " + jsonLatency(snapshot.open) + ", \"read\": " + jsonLatency(snapshot.read) + "},\n";
+        json += "  \"queue\": {\"high_water_mark\": " + std::to_string(snapshot.pipeline.queue_high_water_mark) +
+                ", \"capacity\": " + std::to_string(snapshot.pipeline.queue_capacity) + ", \"batch_size\": " + std::to_string(snapshot.pipeline.batch_size) + "},\n";
+        json += "  \"threads\": " + std::to_string(snapshot.pipeline.threads) + ",\n";
+        json += "  \"errors\": [";
+        bool first = true;
+        for (const auto& [error, count] : snapshot.errors) {
+            json += first ? "\n" : ",\n";
+            json += "    {\"errno\": " + std::to_string(error) + ", \"message\": \"" + escapeJson(std::generic_category().message(error)) +
+                    "\", \"count\": " + std::to_string(count) + "}";
+            first = false;
+        }
+        json += first ? "]\n" : "\n  ]\n";
+        json += "}\n";
+        return json;
+    }
+
+    static void prometheusHeader(std::string& text, const std::string& name, const char* type, const char* help) {
+        text += "# HELP " + name + " " + help + "\n";
+        text += "# TYPE " + name + " " + type + "\n";
+    }
+
+    static void prometheusLatency(std::string& text, const std::string& name, const char* help, const LatencyHistogram& histogram) {
+        prometheusHeader(text, name, "summary", help);
+        const std::pair<const char*, double> quantiles[] = { { "0.5", 50 }, { "0.9", 90 }, { "0.99", 99 }, { "0.999", 99.9 }, { "1", 100 } };
+        for (const auto& [label, percent] : quantiles) {
+            uint64_t value = percent == 100 ? histogram.max() : histogram.percentile(percent);
+            text += name + "{quantile=\"" + label + "\"} " + number(value / 1e9) + "\n";
+        }
+        text += name + "_sum " + number(histogram.sum() / 1e9) + "\n";
+        text += name + "_count " + std::to_string(histogram.count()) + "\n";
+    }
+
+    std::string formatPrometheus(const Snapshot& snapshot) const {
+        const std::string prefix = "dropbox_force_download_";
+        const ProgressTotals& totals = snapshot.totals;
+        std::string text;
+        prometheusHeader(text, prefix + "info", "gauge", "Folder hydrated by the run.");
+        text += prefix + "info{root=\"" + escapeLabel(root_) + "\"} 1\n";
+        prometheusHeader(text, prefix + "finished", "gauge", "1 once the run has finished, 0 while it is running.");
+        text += prefix + "finished " + std::string(snapshot.finished ? "1" : "0") + "\n";
+        prometheusHeader(text, prefix + "success", "gauge", "1 unless the run failed.");
+        text += prefix + "success " + std::string(snapshot.success ? "1" : "0") + "\n";
+        prometheusHeader(text, prefix + "timestamp_seconds", "gauge", "Time the metrics were written, in seconds since the epoch.");
+        text += prefix + "timestamp_seconds " + timestamp(snapshot.timestamp_seconds) + "\n";
+        prometheusHeader(text, prefix + "elapsed_seconds", "gauge", "Duration of the run so far.");
+        text += prefix + "elapsed_seconds " + number(snapshot.elapsed_seconds) + "\n";
+        prometheusHeader(text, prefix + "files", "gauge", "Files of the run by state.");
+        text += prefix + "files{state=\"discovered\"} " + std::to_string(totals.discovered) + "\n";
+        text += prefix + "files{state=\"hydrated\"} " + std::to_string(totals.hydrated) + "\n";
+        text += prefix + "files{state=\"skipped\"} " + std::to_string(totals.skipped) + "\n";
+        text += prefix + "files{state=\"failed\"} " + std::to_string(totals.failed) + "\n";
+        prometheusHeader(text, prefix + "read_bytes", "gauge", "Bytes read from hydrated files.");
+        text += prefix + "read_bytes " + std::to_string(totals.bytes) + "\n";
+        prometheusHeader(text, prefix + "files_per_second", "gauge", "Files hydrated, skipped or failed per second, averaged over the run.");
+        text += prefix + "files_per_second " + number(rate(static_cast<double>(totals.done()), snapshot.elapsed_seconds)) + "\n";
+        prometheusHeader(text, prefix + "read_bytes_per_second", "gauge", "Bytes read per second, averaged over the run.");
+        text += prefix + "read_bytes_per_second " + number(rate(static_cast<double>(totals.bytes), snapshot.elapsed_seconds)) + "\n";
+        prometheusLatency(text, prefix + "open_latency_seconds", "Time to open a file.", snapshot.open);
+        prometheusLatency(text, prefix + "read_latency_seconds", "Time to read a file after it was opened.", snapshot.read);
+        prometheusHeader(text, prefix + "queue_high_water_mark_batches", "gauge", "Most batches waiting for a worker at once.");
+        text += prefix + "queue_high_water_mark_batches " + std::to_string(snapshot.pipeline.queue_high_water_mark) + "\n";
+        prometheusHeader(text, prefix + "queue_capacity_batches", "gauge", "Capacity of the queue between the traversal and the workers.");
+        text += prefix + "queue_capacity_batches " + std::to_string(snapshot.pipeline.queue_capacity) + "\n";
+        prometheusHeader(text, prefix + "threads", "gauge", "Hydration threads.");
+        text += prefix + "threads " + std::to_string(snapshot.pipeline.threads) + "\n";
+        prometheusHeader(text, prefix + "errors", "gauge", "Errors of the run by errno.");
+        for (const auto& [error, count] : snapshot.errors) {
+            text += prefix + "errors{errno=\"" + std::to_string(error) + "\",message=\"" + escapeLabel(std::generic_category().message(error)) + "\"} " +
+                    std::to_string(count) + "\n";
+        }
+        return text;
+    }
+
+    const std::filesystem::path prefix_;
+    // The root as UTF-8, path::string throws on Windows for names outside the code page.
+    const std::string root_;
+    const Progress& progress_;
+    const LatencyStats* latency_;
+    const Sampler sampler_;
+    const Clock::time_point start_;
+
+    std::mutex mutex_;
+    std::condition_variable stop_;
+    bool stopped_ = false;
+    std::thread thread_;
+};
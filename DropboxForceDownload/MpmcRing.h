@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MPMC_RING_PAUSE() _mm_pause()
+#else
+#define MPMC_RING_PAUSE() std::this_thread::yield()
+#endif
+
+// Lock-free bounded multi-producer/multi-consumer queue (Dmitry Vyukov's ring buffer). Every
+// slot carries a sequence number that tells producers and consumers whether it is free or
+// filled, so a push or pop is a single compare-and-swap on the shared position in the common
+// case. A thread that finds the ring full or empty spins for a short while and then parks on
+// a condition variable. Waking parked threads only takes the mutex when someone is asleep.
+// Offers the same interface as BoundedQueue so either can sit behind the workers.
+template <typename T>
+class MpmcRing {
+public:
+    explicit MpmcRing(size_t capacity) : mask_(roundUpToPowerOfTwo(capacity) - 1), cells_(new Cell[mask_ + 1]) {
+        for (size_t i = 0; i <= mask_; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpmcRing(const MpmcRing&) = delete;
+    MpmcRing& operator=(const MpmcRing&) = delete;
+
+    // Blocks while the ring is full. Returns false if the ring was closed.
+    bool push(T item) {
+        if (closed_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        if (!waitUntil([&] { return tryPush(item); }, waiting_producers_, not_full_)) {
+            return false;
+        }
+        updateHighWaterMark();
+        wake(waiting_consumers_, not_empty_);
+        return true;
+    }
+
+    // Blocks while the ring is empty. Returns false once the ring is closed and drained.
+    bool pop(T& item) {
+        if (!waitUntil([&] { return tryPop(item); }, waiting_consumers_, not_empty_)) {
+            return false;
+        }
+        wake(waiting_producers_, not_full_);
+        return true;
+    }
+
+    // Pops an item if one is queued, without waiting. For consumers that have other work.
+    bool poll(T& item) {
+        if (!tryPop(item)) {
+            return false;
+        }
+        wake(waiting_producers_, not_full_);
+        return true;
+    }
+
+    // Wakes every parked thread. Items already queued can still be popped.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(park_mutex_);
+            closed_.store(true, std::memory_order_release);
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    // Non-blocking push. The item is only moved from on success.
+    bool tryPush(T& item) {
+        size_t position = enqueue_position_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[position & mask_];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(item);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = enqueue_position_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Non-blocking pop.
+    bool tryPop(T& item) {
+        size_t position = dequeue_position_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[position & mask_];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (difference == 0) {
+                if (dequeue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    item = std::move(cell.value);
+                    cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = dequeue_position_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t capacity() const {
+        return mask_ + 1;
+    }
+
+    // Largest number of items that were queued at the same time, sampled after each push.
+    size_t highWaterMark() const {
+        return high_water_mark_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int kSpinCount = 64;
+    static constexpr int kYieldCount = 16;
+
+    struct Cell {
+        std::atomic<size_t> sequence{ 0 };
+        T value{};
+    };
+
+    static size_t roundUpToPowerOfTwo(size_t value) {
+        size_t result = 2;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    // Spin, then yield, then park until attempt() succeeds or the ring is closed. A final
+    // attempt after closing lets consumers drain what is left.
+    template <typename Attempt>
+    bool waitUntil(Attempt attempt, std::atomic<size_t>& waiters, std::condition_variable& cv) {
+        for (int i = 0; i < kSpinCount + kYieldCount; ++i) {
+            if (attempt()) {
+                return true;
+            }
+            if (closed_.load(std::memory_order_acquire)) {
+                return attempt();
+            }
+            if (i < kSpinCount) {
+                MPMC_RING_PAUSE();
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool success = false;
+        while (!(success = attempt()) && !closed_.load(std::memory_order_acquire)) {
+            // The timeout is only a safety net, wake() normally ends the wait.
+            cv.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        if (!success) {
+            success = attempt();
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return success;
+    }
+
+    void wake(std::atomic<size_t>& waiters, std::condition_variable& cv) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        // Taking the mutex orders this notify after the waiter's last attempt.
+        { std::lock_guard<std::mutex> lock(park_mutex_); }
+        cv.notify_one();
+    }
+
+    void updateHighWaterMark() {
+        size_t size = enqueue_position_.load(std::memory_order_relaxed) - dequeue_position_.load(std::memory_order_relaxed);
+        size_t current = high_water_mark_.load(std::memory_order_relaxed);
+        while (size > current && size <= capacity() && !high_water_mark_.compare_exchange_weak(current, size, std::memory_order_relaxed)) {
+        }
+    }
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> enqueue_position_{ 0 };
+    alignas(64) std::atomic<size_t> dequeue_position_{ 0 };
+    alignas(64) std::atomic<size_t> high_water_mark_{ 0 };
+    std::atomic<size_t> waiting_producers_{ 0 };
+    std::atomic<size_t> waiting_consumers_{ 0 };
+    std::atomic<bool> closed_{ false };
+    std::mutex park_mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// Implementation of the queue between the traversal and the workers.
+enum class QueueKind {
+    LockFree, // MpmcRing: lock-free ring, spins then parks when full or empty.
+    Mutex,    // BoundedQueue: deque guarded by a mutex and condition variables.
+};
+
+// How files are hydrated.
+enum class Engine {
+    Threads, // Blocking reads on a pool of worker threads.
+    Uring,   // io_uring with many opens and reads in flight per thread (Linux only).
+};
+
+// How the thread pool engine reads the head of each file.
+enum class Reader {
+    Stream, // std::ifstream.
+    Posix,  // open and pread into a reused per-thread buffer (not on Windows).
+};
+
+// Which bytes of each file are read to make the sync client hydrate it.
+enum class Hydration {
+    Head,   // The first hydration_bytes, enough for providers that fetch the whole file on first touch.
+    Tail,   // The last hydration_bytes.
+    Stride, // One byte every hydration_stride bytes, so a provider that fetches by range fetches every range.
+    Full,   // Every byte, streamed through a large buffer.
+};
+
+// How files that are already stored locally are recognized and skipped.
+enum class ResidencyCheck {
+    Off,            // Read every file.
+    Blocks,         // Allocated blocks cover the file size (not on Windows).
+    BlocksAndHoles, // Blocks, confirmed by SEEK_HOLE finding no hole before the end (not on Windows).
+    Attributes,     // No cloud placeholder attributes are set (Windows only).
+};
+
+// Verbosity of the log, each level includes the ones above it.
+enum class LogLevel {
+    Error,   // Files that cannot be hydrated and fatal errors.
+    Warning, // Fallbacks to other implementations.
+    Info,    // Settings and statistics of the run.
+    Debug,   // Every file as it is read or skipped.
+};
+
+// When the progress line is shown.
+enum class ProgressDisplay {
+    Auto,   // When standard error is a terminal and the log level is below debug.
+    Always,
+    Never,
+};
+
+// Latency of a simulated operation: log-normal with this median and 99th percentile, fixed if
+// they are equal.
+struct LatencyDistribution {
+    uint64_t median_ns = 0;
+    uint64_t p99_ns = 0;
+};
+
+// Sync provider simulated by --simulate, to benchmark without a cloud client.
+struct SimulationSettings {
+    bool enabled = false;
+
+    // Waited before a file can be opened, plus byte_ns per byte of its size, like a download.
+    LatencyDistribution open;
+    double byte_ns = 0;
+
+    // Waited before a directory is listed.
+    LatencyDistribution list;
+
+    // Opens per second and hydrations in flight the provider allows, 0 means no limit.
+    double opens_per_second = 0;
+    unsigned concurrency = 0;
+
+    // Percentage of opens that fail with EIO.
+    double error_percent = 0;
+
+    // Varies which files are slow or fail, each file is the same in every run with one seed.
+    uint64_t seed = 1;
+};
+
+// Runtime settings parsed from the command line.
+struct Options {
+    // Messages up to this level are logged, the "debug" argument sets LogLevel::Debug.
+    LogLevel log_level = LogLevel::Warning;
+
+    // Log file instead of standard output and standard error. Empty means the console.
+    std::filesystem::path log_file;
+
+    // Status line with counts, rate and time left, redrawn about once a second.
+    ProgressDisplay progress = ProgressDisplay::Auto;
+
+    // Metrics written to <metrics_out>.json and <metrics_out>.prom at the end of the run and,
+    // if metrics_interval is not 0, every that many seconds. Empty means no metrics.
+    std::filesystem::path metrics_out;
+    unsigned metrics_interval = 0;
+
+    // Chrome trace of the pipeline written at the end of the run, empty means no tracing. Each
+    // thread keeps its last trace_events spans.
+    std::filesystem::path trace_file;
+    size_t trace_events = 65536;
+
+    // Enumerate directories on a pool of work-stealing threads instead of recursively on the main thread.
+    bool parallel_traversal = false;
+
+    // Number of traversal threads in parallel mode, 0 means one per hardware thread.
+    unsigned traversal_threads = 0;
+
+    // Hold directory descriptors and use openat/fstatat with names relative to them, so the
+    // kernel does not resolve the full path of every file again (not on Windows).
+    bool dirfd = false;
+
+    // With dirfd, list directories with getdents64 and a large buffer instead of readdir (Linux only).
+    bool getdents = true;
+
+    // Maximum number of files waiting for a worker. The traversal blocks when the queue is full,
+    // so memory use stays flat regardless of the size of the tree.
+    size_t queue_capacity = 65536;
+
+    QueueKind queue = QueueKind::LockFree;
+
+    // Files are pushed and popped in batches of up to this many paths from the same directory,
+    // so synchronization and wakeups are amortized over the batch.
+    size_t batch_size = 64;
+
+    Engine engine = Engine::Threads;
+
+    // Number of thread pool workers. 0 lets the pool adapt its size between min_threads and
+    // max_threads to the measured latency and throughput of the files it opens.
+    unsigned threads = 0;
+    unsigned min_threads = 4;
+    unsigned max_threads = 256;
+
+#ifdef _WIN32
+    Reader reader = Reader::Stream;
+#else
+    Reader reader = Reader::Posix;
+#endif
+
+    // Which bytes of each file are read. hydration_bytes is the size of the head or tail that
+    // is read, hydration_stride the distance between the bytes read with Hydration::Stride.
+    // The default stride is the 4 MB block size Dropbox stores files in.
+    Hydration hydration = Hydration::Head;
+    size_t hydration_bytes = 1024;
+    size_t hydration_stride = 4 * 1024 * 1024;
+
+    // Size of the buffer Hydration::Full streams each file through, rounded up to whole pages.
+    size_t read_buffer_size = 1024 * 1024;
+
+    // With Hydration::Full, open files with O_DIRECT so the data read does not go through the
+    // page cache. File systems that do not support it are read normally (not on Windows).
+    bool direct_io = false;
+
+    // Drop the pages of every file from the page cache with POSIX_FADV_DONTNEED once it has
+    // been read, so hydrating does not evict the cache of other programs (not on Windows).
+    bool drop_cache = false;
+
+    ResidencyCheck residency_check = ResidencyCheck::Off;
+
+    // State file recording the (device, inode, size, mtime) of every hydrated file. Files that
+    // are unchanged since are skipped without being opened. Empty means no state file (not on Windows).
+    std::filesystem::path state_file;
+
+    // Snapshot recording the modification time and subdirectory count of every directory.
+    // Directories that are unchanged since a run that hydrated all their files are not listed
+    // again. Empty means no snapshot.
+    std::filesystem::path snapshot_file;
+
+    // Latencies, limits and errors injected in front of every open and listing.
+    SimulationSettings simulation;
+
+    // Files in flight per io_uring thread, and the number of such threads.
+    unsigned uring_depth = 256;
+    unsigned uring_threads = 2;
+};
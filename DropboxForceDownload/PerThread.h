@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// One instance of T per thread that uses it, so threads can count without sharing cache lines
+// or taking locks. Instances are registered on first use and live as long as the container,
+// also after their thread exited, so forEach sees everything that was recorded. The deque
+// keeps instances in place while more are added.
+template <typename T>
+class PerThread {
+public:
+    // This thread's instance.
+    T& local() {
+        struct Cache {
+            const PerThread* owner = nullptr;
+            uint64_t generation = 0;
+            T* instance = nullptr;
+        };
+        static thread_local Cache cache;
+        if (cache.owner != this || cache.generation != generation_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cache.owner = this;
+            cache.generation = generation_;
+            cache.instance = &instances_.emplace_back();
+        }
+        return *cache.instance;
+    }
+
+    // Calls function with every instance. Other threads may still be writing to theirs.
+    template <typename Function>
+    void forEach(Function function) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const T& instance : instances_) {
+            function(instance);
+        }
+    }
+
+private:
+    // Distinguishes containers that happen to reuse the address of an earlier one.
+    static uint64_t nextGeneration() {
+        static std::atomic<uint64_t> generation{ 0 };
+        return ++generation;
+    }
+
+    const uint64_t generation_ = nextGeneration();
+    mutable std::mutex mutex_;
+    std::deque<T> instances_;
+};
+
+// Function to add to a counter that only the calling thread writes, so a relaxed load and
+// store are enough where a read-modify-write would lock the bus.
+inline void addToOwnCounter(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
@@ -0,0 +1,459 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "AdaptivePool.h"
+#include "BoundedQueue.h"
+#include "DirectorySnapshot.h"
+#include "FileReaders.h"
+#include "FileSystemOps.h"
+#include "HydrationState.h"
+#include "LatencyHistogram.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "MpmcRing.h"
+#include "Options.h"
+#include "Progress.h"
+#include "ProviderSimulator.h"
+#include "Residency.h"
+#include "RunContext.h"
+#include "Tracer.h"
+#include "Traversal.h"
+#include "UringHydrator.h"
+
+// The traversal and hydration pipeline of the tool, shared with the benchmarks.
+
+// Function to format the rate of a run: files and bytes per second over the whole run, and
+// bytes per second while a file was being read, which is the streaming speed of a full read
+// whatever the time spent on opens and on files that were skipped.
+inline std::string formatThroughput(const ProgressTotals& totals, double elapsed_seconds, const LatencyHistogram& read) {
+    double read_seconds = static_cast<double>(read.sum()) / 1e9;
+    char text[128];
+    std::snprintf(text, sizeof(text), "%.0f files/s, %.1f MB/s over %.2f s, %.1f MB/s while reading", elapsed_seconds > 0 ? totals.done() / elapsed_seconds : 0.0,
+                  elapsed_seconds > 0 ? totals.bytes / elapsed_seconds / 1e6 : 0.0, elapsed_seconds, read_seconds > 0 ? totals.bytes / read_seconds / 1e6 : 0.0);
+    return text;
+}
+
+// Function to format the size of the page cache before and after the run and how it changed.
+inline std::string formatPageCacheDelta(uint64_t before, uint64_t after) {
+    char text[128];
+    std::snprintf(text, sizeof(text), "%.1f MB before, %.1f MB after, %+.1f MB", before / 1e6, after / 1e6,
+                  (static_cast<double>(after) - static_cast<double>(before)) / 1e6);
+    return text;
+}
+
+// What the check before reading found out about a queued file.
+struct FileCheck {
+    bool skip = false;
+#ifndef _WIN32
+    // Set when the file has to be recorded in the state file after it was read.
+    bool record = false;
+    FileIdentity identity;
+#endif
+};
+
+// Function to check a queued file before it is read. Files that are unchanged since their
+// last successful hydration, or that are already stored locally, are skipped. Both checks
+// share a single stat.
+inline FileCheck checkFile(const Directory& directory, FileName name, const RunContext& context) {
+    const Options& options = context.options;
+    const HydrationState* state = context.state;
+    FileCheck check;
+#ifdef _WIN32
+    check.skip = isResident(directory, name, options.residency_check);
+    if (check.skip && logger.enabled(LogLevel::Debug)) {
+        logger.log(LogLevel::Debug, "Already local: ", QueuedFilePath{ directory, name });
+    }
+#else
+    struct stat status;
+    if ((state == nullptr && options.residency_check == ResidencyCheck::Off) || !statQueuedFile(directory, name, status)) {
+        return check;
+    }
+    if (state != nullptr) {
+        check.identity = FileIdentity::fromStat(status);
+        if (state->contains(check.identity)) {
+            if (logger.enabled(LogLevel::Debug)) {
+                logger.log(LogLevel::Debug, "Unchanged since last run: ", QueuedFilePath{ directory, name });
+            }
+            check.skip = true;
+            return check;
+        }
+        check.record = true;
+    }
+    if (isResident(directory, name, status, options.residency_check)) {
+        if (logger.enabled(LogLevel::Debug)) {
+            logger.log(LogLevel::Debug, "Already local: ", QueuedFilePath{ directory, name });
+        }
+        check.skip = true;
+    }
+#endif
+    return check;
+}
+
+// Function to remember a file that was hydrated, so unchanged files are skipped next run.
+inline void recordHydratedFile(const FileCheck& check, HydrationState* state) {
+#ifndef _WIN32
+    if (check.record && state != nullptr) {
+        state->record(check.identity);
+    }
+#endif
+}
+
+// Function to process individual files with the file system operations of the run. Returns
+// false if the file was skipped without being opened.
+template <typename Ops>
+bool processFile(const Directory& directory, FileName name, const RunContext& context, const Ops& ops) {
+    if (name[0] == '\0') {
+        logger.log(LogLevel::Error, "Encountered an empty file path.");
+        return false;
+    }
+
+    FileCheck check = checkFile(directory, name, context);
+    if (check.skip) {
+        if (context.progress != nullptr) {
+            context.progress->addSkipped();
+        }
+        return false;
+    }
+
+    if (logger.enabled(LogLevel::Debug)) {
+        logger.log(LogLevel::Debug, "Downloading file: ", QueuedFilePath{ directory, name });
+    }
+
+    // Read what the hydration mode asks for, by default the first 1 KB. The errno of a failed open or read is kept before the bookkeeping below.
+    // A failure without an errno, which std::ifstream does not promise, is counted as EIO.
+    ReadTimings timings;
+    errno = 0;
+    long long bytes = ops.readFile(directory, name, context.latency != nullptr || context.tracer != nullptr ? &timings : nullptr);
+    int error = errno != 0 ? errno : EIO;
+    if (context.latency != nullptr) {
+        context.latency->recordOpen(timings.open_ns);
+        if (bytes != kUnableToOpen) {
+            context.latency->recordRead(timings.read_ns);
+        }
+    }
+    if (context.tracer != nullptr) {
+        uint64_t opened = timings.start_ns + timings.open_ns;
+        context.tracer->record(SpanKind::Open, timings.start_ns, opened);
+        if (bytes != kUnableToOpen) {
+            context.tracer->record(SpanKind::Read, opened, opened + timings.read_ns);
+            context.tracer->record(SpanKind::Close, opened + timings.read_ns, opened + timings.read_ns + timings.close_ns);
+        }
+    }
+    if (bytes < 0) {
+        logger.log(LogLevel::Error, bytes == kUnableToRead ? "Unable to read file: " : "Unable to open file: ", QueuedFilePath{ directory, name });
+        directory.markIncomplete();
+        if (context.progress != nullptr) {
+            context.progress->addFailed(error);
+        }
+        return true;
+    }
+    recordHydratedFile(check, context.state);
+    if (context.progress != nullptr) {
+        context.progress->addHydrated(static_cast<uint64_t>(bytes));
+    }
+    return true;
+}
+
+// Function to run the traversal and the worker threads with the given file system operations
+// on top of the given file queue.
+template <typename Ops, typename Queue>
+void runPipeline(const std::filesystem::path& directory_path, const RunContext& context, const Ops& ops, Queue& files) {
+    const Options& options = context.options;
+    std::vector<std::thread> workers;
+
+    // Worker function for threads to process files from the queue. Workers of the adaptive
+    // pool report the files they opened and the time it took, and park while the pool is smaller.
+    // Takes the next batch from the queue, the wait for it is a span of the trace.
+    auto pop = [&](FileBatch& batch) {
+        TraceScope span(context.tracer, SpanKind::QueueWait);
+        return files.pop(batch);
+    };
+
+    auto worker = [&](AdaptivePool* pool, unsigned index) {
+        FileBatch batch;
+        while ((pool == nullptr || pool->waitUntilActive(index)) && pop(batch)) {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto start = std::chrono::steady_clock::now();
+                bool opened = processFile(*batch.directory, batch.name(i), context, ops);
+                if (pool != nullptr) {
+                    pool->record(index, opened ? 1 : 0, std::chrono::steady_clock::now() - start);
+                }
+            }
+        }
+    };
+
+#ifdef __linux__
+    // Worker function for the io_uring engine. Each thread drives its own ring and keeps up
+    // to uring_depth files in flight. A thread whose ring cannot be created processes files
+    // synchronously instead.
+    auto uring_worker = [&]() {
+        std::unique_ptr<UringHydrator> ring;
+        try {
+            ring = std::make_unique<UringHydrator>(options.uring_depth, HydrationPlan(options), context.state, context.progress, context.latency, context.tracer);
+        }
+        catch (const std::system_error&) {
+            worker(nullptr, 0);
+            return;
+        }
+        // While files are in flight the thread only takes a batch that is already queued, and
+        // otherwise waits briefly for completions, so reads and closes are not held up by the
+        // traversal and new batches are not held up by slow opens.
+        FileBatch batch;
+        while (true) {
+            if (ring->busy()) {
+                if (!files.poll(batch)) {
+                    ring->wait(std::chrono::milliseconds(2));
+                    continue;
+                }
+            }
+            else if (!pop(batch)) {
+                break;
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                FileName name = batch.name(i);
+                FileCheck check = checkFile(*batch.directory, name, context);
+                if (!check.skip) {
+                    ring->add(batch.directory, name, check.record ? &check.identity : nullptr);
+                }
+                else if (context.progress != nullptr) {
+                    context.progress->addSkipped();
+                }
+            }
+            ring->submit();
+        }
+        ring->drain();
+    };
+#endif
+
+    // Creating the worker threads: a few io_uring threads, or a pool that starts at one
+    // thread per core and adapts its size to the latency of the sync provider unless --threads
+    // fixes it.
+    unsigned min_threads = options.threads != 0 ? options.threads : options.min_threads;
+    unsigned max_threads = options.threads != 0 ? options.threads : options.max_threads;
+    AdaptivePool pool(min_threads, max_threads, std::max(1u, std::thread::hardware_concurrency()));
+#ifdef __linux__
+    if constexpr (Ops::kUring) {
+        logger.log(LogLevel::Info, "Threads: ", options.uring_threads);
+        for (unsigned i = 0; i < options.uring_threads; ++i) {
+            workers.emplace_back(uring_worker);
+        }
+    }
+#endif
+    if (workers.empty()) {
+        if (min_threads == max_threads) {
+            logger.log(LogLevel::Info, "Threads: ", pool.size());
+        }
+        else {
+            logger.log(LogLevel::Info, "Threads: ", pool.size(), ", adapting between ", min_threads, " and ", max_threads);
+        }
+        pool.start([&](unsigned index) { worker(&pool, index); });
+    }
+
+    // Metrics for dashboards, written at the end and, with an interval, while the run goes on.
+    std::unique_ptr<MetricsWriter> metrics;
+    if (!options.metrics_out.empty() && context.progress != nullptr) {
+        unsigned uring_threads = static_cast<unsigned>(workers.size());
+        metrics = std::make_unique<MetricsWriter>(options.metrics_out, options.metrics_interval, directory_path, *context.progress, context.latency, [&, uring_threads]() {
+            return PipelineSample{ files.highWaterMark(), files.capacity(), options.batch_size, uring_threads != 0 ? uring_threads : pool.size() };
+        });
+    }
+
+    // Starting the directory traversal, either recursively on this thread or on a work-stealing pool.
+    // The workers are always joined, also when the traversal fails, before the error is passed on.
+    std::exception_ptr error;
+    try {
+        DirectoryPtr root = ops.openRoot(directory_path);
+        if (options.parallel_traversal) {
+            unsigned traversal_threads = options.traversal_threads != 0 ? options.traversal_threads : std::max(1u, std::thread::hardware_concurrency());
+            logger.log(LogLevel::Info, "Traversal threads: ", traversal_threads);
+            parallelTraverseDirectory(root, traversal_threads, files, context, ops);
+        }
+        else {
+            traverseDirectory(root, files, context, ops);
+        }
+    }
+    catch (const std::system_error& e) {
+        error = std::current_exception();
+        if (context.progress != nullptr) {
+            context.progress->addError(e.code().value());
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    if (context.progress != nullptr) {
+        context.progress->setTraversalDone();
+    }
+
+    // Signaling the workers that traversal is complete.
+    files.close();
+
+    // Joining all worker threads.
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    pool.finish();
+
+    logger.log(LogLevel::Info, "Queue high-water mark: ", files.highWaterMark(), " of ", files.capacity(), " batches of up to ", options.batch_size, " files");
+
+    // A failed run still writes its metrics and trace, the error of the run is the one passed on.
+    if (metrics) {
+        try {
+            metrics->finish(!error);
+        }
+        catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (context.tracer != nullptr) {
+        try {
+            context.tracer->write(options.trace_file);
+            logger.log(LogLevel::Info, "Trace file: ", options.trace_file, ", ", context.tracer->dropped(), " spans dropped");
+        }
+        catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Function to start directory traversal and manage threads. Returns the file counts of the run.
+inline ProgressTotals startDirectoryTraversal(const std::filesystem::path& requested_path, const Options& requested_options) {
+    // Without a trailing separator, so the root is named like the paths of its subdirectories.
+    std::filesystem::path directory_path = requested_path.has_filename() ? requested_path : requested_path.parent_path();
+
+    // Fall back to the thread pool when the kernel does not offer io_uring.
+    Options options = requested_options;
+    if (options.engine == Engine::Uring) {
+#ifdef __linux__
+        bool uring_supported = UringHydrator::isSupported();
+#else
+        bool uring_supported = false;
+#endif
+        if (!uring_supported) {
+            logger.log(LogLevel::Warning, "io_uring is not available, using the thread pool instead.");
+            options.engine = Engine::Threads;
+        }
+    }
+    // The simulated provider blocks the calling thread, which would stall a whole io_uring ring.
+    if (options.simulation.enabled && options.engine == Engine::Uring) {
+        logger.log(LogLevel::Warning, "The simulated provider needs the thread pool, not using io_uring.");
+        options.engine = Engine::Threads;
+    }
+#ifndef _WIN32
+    // std::ifstream does not give access to the descriptor the pages are dropped through.
+    if (options.drop_cache && options.reader == Reader::Stream && !options.dirfd && options.engine == Engine::Threads) {
+        logger.log(LogLevel::Warning, "Dropping the page cache needs the posix reader, not using ifstream.");
+        options.reader = Reader::Posix;
+    }
+    if (options.dirfd) {
+        raiseOpenFileLimit();
+    }
+#endif
+
+    // Files recorded in the state file by earlier runs are skipped if they did not change.
+    std::unique_ptr<HydrationState> state;
+#ifndef _WIN32
+    if (!options.state_file.empty()) {
+        state = std::make_unique<HydrationState>(options.state_file);
+        logger.log(LogLevel::Info, "State file: ", state->size(), " files recorded");
+    }
+#endif
+
+    // Directories unchanged since the run that wrote the snapshot are not listed again.
+    std::unique_ptr<DirectorySnapshot> snapshot;
+    if (!options.snapshot_file.empty()) {
+        snapshot = std::make_unique<DirectorySnapshot>(options.snapshot_file, directory_path);
+        logger.log(LogLevel::Info, "Snapshot file: ", snapshot->previousSize(), " directories recorded");
+    }
+
+    // Files are always counted, the status line is only drawn where it can be redrawn in place.
+    Progress progress;
+    bool show_progress = options.progress == ProgressDisplay::Always || (options.progress == ProgressDisplay::Auto && options.log_level < LogLevel::Debug && isStatusTerminal());
+    std::unique_ptr<ProgressReporter> reporter;
+    if (show_progress) {
+        reporter = std::make_unique<ProgressReporter>(progress);
+    }
+
+    // Latencies are recorded for the report at the end, which is only printed at info level,
+    // and for the metrics.
+    std::unique_ptr<LatencyStats> latency;
+    if (logger.enabled(LogLevel::Info) || !options.metrics_out.empty()) {
+        latency = std::make_unique<LatencyStats>();
+    }
+
+    std::unique_ptr<Tracer> tracer;
+    if (!options.trace_file.empty()) {
+        tracer = std::make_unique<Tracer>(options.trace_events);
+    }
+
+    std::unique_ptr<ProviderSimulator> simulator;
+    if (options.simulation.enabled) {
+        simulator = std::make_unique<ProviderSimulator>(options.simulation);
+    }
+
+    RunContext context{ options, state.get(), snapshot.get(), &progress, latency.get(), tracer.get() };
+
+    // The file system operations and the queue are picked here, once; the pipeline is
+    // instantiated for each combination. The capacity is given in files, the queue holds batches.
+    size_t batch_capacity = (options.queue_capacity + options.batch_size - 1) / options.batch_size;
+    // The page cache of the whole system before and after the run, to show how much hydrating grew it.
+#ifdef __linux__
+    uint64_t cache_before = 0;
+    bool cache_known = logger.enabled(LogLevel::Info) && readPageCacheSize(cache_before);
+#endif
+    auto start = std::chrono::steady_clock::now();
+    withFileSystemOps(options, simulator.get(), [&](const auto& ops) {
+        if (options.queue == QueueKind::Mutex) {
+            BoundedQueue<FileBatch> files(batch_capacity);
+            runPipeline(directory_path, context, ops, files);
+        }
+        else {
+            MpmcRing<FileBatch> files(batch_capacity);
+            runPipeline(directory_path, context, ops, files);
+        }
+    });
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (reporter) {
+        reporter->stop();
+    }
+    if (latency && logger.enabled(LogLevel::Info)) {
+        LatencyHistogram open;
+        LatencyHistogram read;
+        latency->merge(open, read);
+        logger.log(LogLevel::Info, "Open latency: ", formatPercentiles(open));
+        logger.log(LogLevel::Info, "Read latency: ", formatPercentiles(read));
+        logger.log(LogLevel::Info, "Throughput: ", formatThroughput(progress.totals(), elapsed, read));
+    }
+#ifdef __linux__
+    uint64_t cache_after = 0;
+    if (cache_known && readPageCacheSize(cache_after)) {
+        logger.log(LogLevel::Info, "Page cache: ", formatPageCacheDelta(cache_before, cache_after));
+    }
+#endif
+
+    // Only a run that finished writes a snapshot, so a failed run is repeated in full.
+    if (snapshot) {
+        logger.log(LogLevel::Info, "Directories skipped: ", snapshot->reusedCount());
+        snapshot->save();
+    }
+    return progress.totals();
+}
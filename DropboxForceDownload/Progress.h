@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Logger.h"
+#include "PerThread.h"
+
+// Totals of the progress counters.
+struct ProgressTotals {
+    uint64_t discovered = 0;
+    uint64_t hydrated = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+
+    uint64_t done() const {
+        return hydrated + skipped + failed;
+    }
+};
+
+// Counters of the run, kept per thread on their own cache line. Each thread only writes its
+// own counters with plain relaxed stores, so counting costs no lock and no contended atomic
+// operation; the reporter sums them when it prints.
+class Progress {
+public:
+    // Files queued by the traversal.
+    void addDiscovered(uint64_t files) {
+        add(local().discovered, files);
+    }
+
+    // A file that was opened and read.
+    void addHydrated(uint64_t bytes) {
+        Counters& counters = local();
+        add(counters.hydrated, 1);
+        add(counters.bytes, bytes);
+    }
+
+    // A file that did not have to be opened.
+    void addSkipped() {
+        add(local().skipped, 1);
+    }
+
+    // A file that could not be opened or read, with the errno of the failure.
+    void addFailed(int error) {
+        add(local().failed, 1);
+        addError(error);
+    }
+
+    // Counts an error by its errno. Errors are rare, so they are counted under a lock.
+    void addError(int error) {
+        std::lock_guard<std::mutex> lock(errors_mutex_);
+        ++errors_[error];
+    }
+
+    // Number of errors by errno.
+    std::map<int, uint64_t> errors() const {
+        std::lock_guard<std::mutex> lock(errors_mutex_);
+        return errors_;
+    }
+
+    // Called when the traversal has queued every file, from then on the total is known.
+    void setTraversalDone() {
+        traversal_done_.store(true, std::memory_order_relaxed);
+    }
+
+    bool traversalDone() const {
+        return traversal_done_.load(std::memory_order_relaxed);
+    }
+
+    ProgressTotals totals() const {
+        ProgressTotals totals;
+        counters_.forEach([&](const Counters& counters) {
+            totals.discovered += counters.discovered.load(std::memory_order_relaxed);
+            totals.hydrated += counters.hydrated.load(std::memory_order_relaxed);
+            totals.skipped += counters.skipped.load(std::memory_order_relaxed);
+            totals.failed += counters.failed.load(std::memory_order_relaxed);
+            totals.bytes += counters.bytes.load(std::memory_order_relaxed);
+        });
+        return totals;
+    }
+
+private:
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> discovered{ 0 };
+        std::atomic<uint64_t> hydrated{ 0 };
+        std::atomic<uint64_t> skipped{ 0 };
+        std::atomic<uint64_t> failed{ 0 };
+        std::atomic<uint64_t> bytes{ 0 };
+    };
+
+    Counters& local() {
+        return counters_.local();
+    }
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+        addToOwnCounter(counter, value);
+    }
+
+    std::atomic<bool> traversal_done_{ false };
+    PerThread<Counters> counters_;
+    mutable std::mutex errors_mutex_;
+    std::map<int, uint64_t> errors_;
+};
+
+// Function to check whether standard error is a terminal, where the status line can be redrawn.
+inline bool isStatusTerminal() {
+#ifdef _WIN32
+    return _isatty(_fileno(stderr)) != 0;
+#else
+    return isatty(STDERR_FILENO) != 0;
+#endif
+}
+
+// Prints a status line to standard error about once a second, redrawn in place: files done
+// and found, the split into hydrated, skipped and failed, the rate over the last seconds and,
+// once the traversal has found every file, the time left.
+class ProgressReporter {
+public:
+    explicit ProgressReporter(const Progress& progress, std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+        : progress_(progress), interval_(interval), start_(Clock::now()) {
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    ~ProgressReporter() {
+        stop();
+    }
+
+    // Stops the reporter and prints the final line.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopped_) {
+                return;
+            }
+            stopped_ = true;
+        }
+        stop_.notify_all();
+        thread_.join();
+        print(true);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_.wait_for(lock, interval_, [&]() { return stopped_; })) {
+            lock.unlock();
+            print(false);
+            lock.lock();
+        }
+    }
+
+    // Formats a count with thousands separators.
+    static std::string formatCount(uint64_t value) {
+        std::string digits = std::to_string(value);
+        std::string result;
+        for (size_t i = 0; i < digits.size(); ++i) {
+            if (i > 0 && (digits.size() - i) % 3 == 0) {
+                result += ',';
+            }
+            result += digits[i];
+        }
+        return result;
+    }
+
+    static std::string formatDuration(double seconds) {
+        uint64_t total = static_cast<uint64_t>(seconds + 0.5);
+        char text[32];
+        if (total >= 3600) {
+            std::snprintf(text, sizeof(text), "%llu:%02llu:%02llu", static_cast<unsigned long long>(total / 3600),
+                          static_cast<unsigned long long>(total / 60 % 60), static_cast<unsigned long long>(total % 60));
+        }
+        else {
+            std::snprintf(text, sizeof(text), "%llu:%02llu", static_cast<unsigned long long>(total / 60), static_cast<unsigned long long>(total % 60));
+        }
+        return text;
+    }
+
+    void print(bool final) {
+        Clock::time_point now = Clock::now();
+        ProgressTotals totals = progress_.totals();
+        double elapsed = std::chrono::duration<double>(now - last_time_).count();
+        double files_per_second = 0;
+        double bytes_per_second = 0;
+        if (final) {
+            double total_elapsed = std::chrono::duration<double>(now - start_).count();
+            files_per_second = total_elapsed > 0 ? totals.done() / total_elapsed : 0;
+            bytes_per_second = total_elapsed > 0 ? totals.bytes / total_elapsed : 0;
+        }
+        else if (elapsed > 0) {
+            // Smoothed, so the rate and the time left do not jump around every second.
+            double files_rate = (totals.done() - last_.done()) / elapsed;
+            double bytes_rate = (totals.bytes - last_.bytes) / elapsed;
+            files_rate_ = has_rate_ ? files_rate_ * 0.7 + files_rate * 0.3 : files_rate;
+            bytes_rate_ = has_rate_ ? bytes_rate_ * 0.7 + bytes_rate * 0.3 : bytes_rate;
+            has_rate_ = true;
+            files_per_second = files_rate_;
+            bytes_per_second = bytes_rate_;
+        }
+        last_ = totals;
+        last_time_ = now;
+
+        char megabytes[32];
+        std::snprintf(megabytes, sizeof(megabytes), "%.1f MB/s", bytes_per_second / 1e6);
+        std::string rates = formatCount(static_cast<uint64_t>(files_per_second + 0.5)) + " files/s, " + megabytes;
+        std::string line = formatCount(totals.done()) + " of " + formatCount(totals.discovered) + (progress_.traversalDone() ? "" : "+") + " files (" +
+                           formatCount(totals.hydrated) + " hydrated, " + formatCount(totals.skipped) + " skipped, " + formatCount(totals.failed) + " failed), " + rates;
+        if (final) {
+            line += ", " + formatDuration(std::chrono::duration<double>(now - start_).count());
+        }
+        else if (progress_.traversalDone() && files_per_second > 0) {
+            line += ", " + formatDuration((totals.discovered - totals.done()) / files_per_second) + " left";
+        }
+
+        // Pad over the rest of the previous, possibly longer, line. Log records clear the line
+        // and draw it again, see status_line, so they are not written into the middle of it.
+        std::string padded = line;
+        if (padded.size() < last_length_) {
+            padded.append(last_length_ - padded.size(), ' ');
+        }
+        last_length_ = line.size();
+
+        std::lock_guard<std::mutex> guard(console_mutex);
+        std::cerr << '\r' << padded << (final ? "\n" : "") << std::flush;
+        status_line = final ? std::string() : std::move(line);
+    }
+
+    const Progress& progress_;
+    const std::chrono::milliseconds interval_;
+    const Clock::time_point start_;
+    Clock::time_point last_time_ = start_;
+    ProgressTotals last_;
+    double files_rate_ = 0;
+    double bytes_rate_ = 0;
+    bool has_rate_ = false;
+    size_t last_length_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable stop_;
+    bool stopped_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#include "FileBatch.h"
+#include "Options.h"
+
+// Function to parse a duration such as 0.5ns, 250us, 20ms or 1.5s into nanoseconds.
+inline bool parseDuration(const std::string& text, double& nanoseconds) {
+    char* end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    std::string unit = end != nullptr ? end : "";
+    double scale = 0;
+    if (unit == "ns") {
+        scale = 1;
+    }
+    else if (unit == "us") {
+        scale = 1e3;
+    }
+    else if (unit == "ms") {
+        scale = 1e6;
+    }
+    else if (unit == "s") {
+        scale = 1e9;
+    }
+    if (end == text.c_str() || scale == 0 || !(value >= 0)) {
+        return false;
+    }
+    nanoseconds = value * scale;
+    return true;
+}
+
+inline bool parseDuration(const std::string& text, uint64_t& nanoseconds) {
+    double value = 0;
+    if (!parseDuration(text, value)) {
+        return false;
+    }
+    nanoseconds = static_cast<uint64_t>(value + 0.5);
+    return true;
+}
+
+// Function to parse a latency distribution: a fixed duration, or median/p99 of a log-normal one.
+inline bool parseLatency(const std::string& text, LatencyDistribution& latency) {
+    size_t slash = text.find('/');
+    if (!parseDuration(text.substr(0, slash), latency.median_ns)) {
+        return false;
+    }
+    latency.p99_ns = latency.median_ns;
+    return slash == std::string::npos || (parseDuration(text.substr(slash + 1), latency.p99_ns) && latency.p99_ns >= latency.median_ns);
+}
+
+// Function to parse the --simulate settings, comma-separated key=value pairs:
+// open=20ms/400ms, byte=10ns, list=2ms, rate=200, concurrency=64, errors=0.5, seed=7.
+inline bool parseSimulation(const std::string& text, SimulationSettings& settings) {
+    settings.enabled = true;
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = text.find(',', begin);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string item = text.substr(begin, end - begin);
+        begin = end + 1;
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) {
+            return false;
+        }
+        std::string key = item.substr(0, equals);
+        std::string value = item.substr(equals + 1);
+        char* value_end = nullptr;
+        bool ok = true;
+        if (key == "open") {
+            ok = parseLatency(value, settings.open);
+        }
+        else if (key == "list") {
+            ok = parseLatency(value, settings.list);
+        }
+        else if (key == "byte") {
+            ok = parseDuration(value, settings.byte_ns);
+        }
+        else if (key == "rate") {
+            settings.opens_per_second = std::strtod(value.c_str(), &value_end);
+        }
+        else if (key == "concurrency") {
+            settings.concurrency = static_cast<unsigned>(std::strtoul(value.c_str(), &value_end, 10));
+        }
+        else if (key == "errors") {
+            settings.error_percent = std::strtod(value.c_str(), &value_end);
+            ok = settings.error_percent >= 0 && settings.error_percent <= 100;
+        }
+        else if (key == "seed") {
+            settings.seed = std::strtoull(value.c_str(), &value_end, 10);
+        }
+        else {
+            return false;
+        }
+        if (!ok || (value_end != nullptr && (value_end == value.c_str() || *value_end != '\0'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Stand-in for a sync provider that hydrates files on open, for benchmarking concurrency
+// without a cloud client. Opening a file waits for a log-normal latency plus a time per byte
+// of the file, bounded by a rate limit on opens and a maximum number of hydrations in flight,
+// and fails with EIO at the given rate; listing a directory waits for its own latency. The
+// latency and failure of a file only depend on its path and the seed, so every run and every
+// engine sees the same provider.
+class ProviderSimulator {
+public:
+    explicit ProviderSimulator(const SimulationSettings& settings) : settings_(settings) {}
+
+    ProviderSimulator(const ProviderSimulator&) = delete;
+    ProviderSimulator& operator=(const ProviderSimulator&) = delete;
+
+    // Waits like the provider hydrating the file would. Returns 0, or the errno of an injected failure.
+    int hydrate(const Directory& directory, FileName name) {
+        uint64_t hash = hashPath(directory.path.native(), name);
+        uint64_t delay_ns = sample(settings_.open, hash);
+        if (settings_.byte_ns > 0) {
+            delay_ns += static_cast<uint64_t>(settings_.byte_ns * static_cast<double>(fileSize(directory, name)));
+        }
+        bool fail = settings_.error_percent > 0 && uniform(mix(hash ^ 0x5bd1e995u)) * 100 < settings_.error_percent;
+
+        waitForRate();
+        acquire();
+        sleepFor(delay_ns);
+        release();
+        return fail ? EIO : 0;
+    }
+
+    // Waits like the provider listing the directory would.
+    void list(const Directory& directory) {
+        sleepFor(sample(settings_.list, hashPath(directory.path.native(), {})));
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    using StringView = std::basic_string_view<std::filesystem::path::value_type>;
+
+    // FNV-1a over the path and the seed, mixed once more so nearby paths spread.
+    uint64_t hashPath(StringView directory, StringView name) const {
+        uint64_t hash = 14695981039346656037ull ^ settings_.seed;
+        auto add = [&](StringView text) {
+            for (auto c : text) {
+                hash = (hash ^ static_cast<uint64_t>(c)) * 1099511628211ull;
+            }
+            hash = (hash ^ '/') * 1099511628211ull;
+        };
+        add(directory);
+        add(name);
+        return mix(hash);
+    }
+
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in (0, 1).
+    static double uniform(uint64_t bits) {
+        return (static_cast<double>(bits >> 11) + 0.5) / 9007199254740992.0;
+    }
+
+    // Log-normal with the given median and 99th percentile, from a Box-Muller normal.
+    static uint64_t sample(const LatencyDistribution& latency, uint64_t hash) {
+        if (latency.median_ns == 0 || latency.p99_ns <= latency.median_ns) {
+            return latency.median_ns;
+        }
+        double normal = std::sqrt(-2.0 * std::log(uniform(mix(hash + 1)))) * std::cos(2.0 * 3.141592653589793 * uniform(mix(hash + 2)));
+        double sigma = std::log(static_cast<double>(latency.p99_ns) / static_cast<double>(latency.median_ns)) / 2.3263;
+        return static_cast<uint64_t>(static_cast<double>(latency.median_ns) * std::exp(sigma * normal));
+    }
+
+    static uint64_t fileSize(const Directory& directory, FileName name) {
+#ifndef _WIN32
+        struct stat status;
+        int result = directory.fd >= 0 ? fstatat(directory.fd, name, &status, 0) : stat((directory.path / name).c_str(), &status);
+        return result == 0 ? static_cast<uint64_t>(status.st_size) : 0;
+#else
+        std::error_code error;
+        uintmax_t size = std::filesystem::file_size(directory.path / name, error);
+        return error ? 0 : static_cast<uint64_t>(size);
+#endif
+    }
+
+    static void sleepFor(uint64_t nanoseconds) {
+        if (nanoseconds > 0) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(nanoseconds));
+        }
+    }
+
+    // Spaces the opens evenly at the configured rate.
+    void waitForRate() {
+        if (settings_.opens_per_second <= 0) {
+            return;
+        }
+        Clock::time_point slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Clock::time_point now = Clock::now();
+            slot = std::max(now, next_open_);
+            next_open_ = slot + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / settings_.opens_per_second));
+        }
+        std::this_thread::sleep_until(slot);
+    }
+
+    void acquire() {
+        if (settings_.concurrency == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        released_.wait(lock, [&]() { return in_flight_ < settings_.concurrency; });
+        ++in_flight_;
+    }
+
+    void release() {
+        if (settings_.concurrency == 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --in_flight_;
+        }
+        released_.notify_one();
+    }
+
+    const SimulationSettings settings_;
+    std::mutex mutex_;
+    std::condition_variable released_;
+    Clock::time_point next_open_;
+    unsigned in_flight_ = 0;
+};
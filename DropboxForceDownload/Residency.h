@@ -0,0 +1,79 @@
+#pragma once
+
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include "FileBatch.h"
+#include "Options.h"
+
+#ifdef _WIN32
+// Cloud placeholders carry recall attributes until their content is stored locally.
+// FILE_ATTRIBUTE_RECALL_ON_OPEN and FILE_ATTRIBUTE_RECALL_ON_DATA_ACCESS are missing from older SDKs.
+constexpr DWORD kPlaceholderAttributes = FILE_ATTRIBUTE_OFFLINE | 0x00040000 | 0x00400000;
+
+// A file is local when none of the placeholder attributes are set.
+inline bool isResidentByAttributes(const std::filesystem::path& file_path) {
+    DWORD attributes = GetFileAttributesW(file_path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & kPlaceholderAttributes) == 0;
+}
+#else
+// Placeholders are sparse: a file is taken to be local when its allocated blocks cover its size.
+inline bool isResidentByBlocks(const struct stat& status) {
+    return status.st_size == 0 || static_cast<long long>(status.st_blocks) * 512 >= static_cast<long long>(status.st_size);
+}
+
+// Second opinion for files that pass the block check: the first hole must be the implicit one
+// at the end of the file. File systems without SEEK_HOLE support report no holes.
+inline bool isResidentBySeek(int directory_fd, const char* name, off_t size) {
+    int fd = openat(directory_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    close(fd);
+    return hole < 0 || hole >= size;
+}
+#endif
+
+#ifdef _WIN32
+// Function to check whether a queued file is already stored locally, so it does not need to be read.
+inline bool isResident(const Directory& directory, FileName name, ResidencyCheck check) {
+    return check != ResidencyCheck::Off && isResidentByAttributes(directory.path / name);
+}
+#else
+// Function to stat a queued file, relative to its directory's descriptor if it has one.
+inline bool statQueuedFile(const Directory& directory, FileName name, struct stat& status) {
+    if (directory.fd >= 0) {
+        return fstatat(directory.fd, name, &status, 0) == 0;
+    }
+    return stat((directory.path / name).c_str(), &status) == 0;
+}
+
+// Function to check whether a queued file is already stored locally, so it does not need to be read.
+inline bool isResident(const Directory& directory, FileName name, const struct stat& status, ResidencyCheck check) {
+    if (check == ResidencyCheck::Off || !isResidentByBlocks(status)) {
+        return false;
+    }
+    if (check != ResidencyCheck::BlocksAndHoles) {
+        return true;
+    }
+    if (directory.fd >= 0) {
+        return isResidentBySeek(directory.fd, name, status.st_size);
+    }
+    return isResidentBySeek(AT_FDCWD, (directory.path / name).c_str(), status.st_size);
+}
+#endif
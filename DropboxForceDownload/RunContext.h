@@ -0,0 +1,28 @@
+#pragma once
+
+#include "DirectorySnapshot.h"
+#include "HydrationState.h"
+#include "LatencyHistogram.h"
+#include "Options.h"
+#include "Progress.h"
+#include "Tracer.h"
+
+// Settings and shared state of one run, handed to the traversal and the workers.
+struct RunContext {
+    const Options& options;
+
+    // Files hydrated by earlier runs, null without --state-file.
+    HydrationState* state = nullptr;
+
+    // Directories seen by the previous run and recorded for the next one, null without --snapshot-file.
+    DirectorySnapshot* snapshot = nullptr;
+
+    // Counters of files found, hydrated, skipped and failed, null if nothing counts them.
+    Progress* progress = nullptr;
+
+    // Open and read latencies of the hydrated files, null if nothing records them.
+    LatencyStats* latency = nullptr;
+
+    // Spans of the pipeline for the trace file, null without --trace.
+    Tracer* tracer = nullptr;
+};
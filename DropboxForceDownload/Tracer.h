@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "FileReaders.h"
+#include "Logger.h"
+#include "PerThread.h"
+
+// Steps of the pipeline that are recorded as spans.
+enum class SpanKind : uint8_t {
+    Enumerate, // Listing a directory, including the subdirectories the recursive traversal descends into.
+    QueueWait, // A worker waiting for the next batch.
+    Open,
+    Read,
+    Close,
+};
+
+// Records spans of the pipeline per thread and writes them as Chrome trace events, which
+// chrome://tracing and Perfetto open. Every thread gets a ring of preallocated events on its
+// first span, so recording is a few stores without a lock or an allocation; when the ring is
+// full the oldest spans are overwritten. Directory paths are kept in a smaller ring of
+// reused strings. The io_uring engine has many files in flight per thread, its spans overlap
+// and are written as async events with the slot as id.
+class Tracer {
+public:
+    explicit Tracer(size_t events_per_thread) : events_per_thread_(events_per_thread), start_ns_(monotonicNanoseconds()) {}
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Records a span measured with monotonicNanoseconds. A non-zero async id marks spans that
+    // overlap others of the same thread.
+    void record(SpanKind kind, uint64_t start_ns, uint64_t end_ns, uint32_t async_id = 0) {
+        Buffer& buffer = local();
+        Event& event = buffer.events[buffer.count % buffer.events.size()];
+        event.start_ns = start_ns;
+        event.duration_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+        event.kind = kind;
+        event.async_id = async_id;
+        event.label = 0;
+        ++buffer.count;
+    }
+
+    // Records a span with a path, shown as an argument of the event. The path is kept as UTF-8
+    // without path::string, which throws on Windows for names outside the code page and is
+    // called from the destructor of a TraceScope.
+    void record(SpanKind kind, uint64_t start_ns, uint64_t end_ns, const std::filesystem::path& path) {
+        record(kind, start_ns, end_ns);
+        Buffer& buffer = local();
+        std::string& label = buffer.labels[buffer.label_count % buffer.labels.size()];
+        label.clear();
+        appendPathText(label, path.c_str(), path.native().size());
+        ++buffer.label_count;
+        buffer.events[(buffer.count - 1) % buffer.events.size()].label = buffer.label_count;
+    }
+
+    // Writes the trace. Called after every thread that records has been joined. Throws
+    // std::system_error if the file cannot be written.
+    void write(const std::filesystem::path& file_path) const {
+        std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), "Unable to open trace file " + file_path.string());
+        }
+        std::string text = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+        bool first = true;
+        unsigned thread_id = 0;
+        buffers_.forEach([&](const Buffer& buffer) {
+            ++thread_id;
+            if (buffer.count == 0) {
+                return;
+            }
+            appendSeparator(text, first);
+            text += "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " + std::to_string(thread_id) + ", \"args\": {\"name\": \"" +
+                    threadName(buffer) + " " + std::to_string(thread_id) + "\"}}";
+            uint64_t capacity = buffer.events.size();
+            uint64_t begin = buffer.count > capacity ? buffer.count - capacity : 0;
+            for (uint64_t i = begin; i < buffer.count; ++i) {
+                appendEvent(text, first, buffer, buffer.events[i % capacity], thread_id);
+                if (text.size() > (1 << 20)) {
+                    file.write(text.data(), static_cast<std::streamsize>(text.size()));
+                    text.clear();
+                }
+            }
+        });
+        text += "\n]}\n";
+        file.write(text.data(), static_cast<std::streamsize>(text.size()));
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), "Unable to write trace file " + file_path.string());
+        }
+    }
+
+    // Spans that were overwritten because a ring was full.
+    uint64_t dropped() const {
+        uint64_t dropped = 0;
+        buffers_.forEach([&](const Buffer& buffer) {
+            if (buffer.count > buffer.events.size()) {
+                dropped += buffer.count - buffer.events.size();
+            }
+        });
+        return dropped;
+    }
+
+private:
+    static constexpr size_t kLabelsPerThread = 4096;
+
+    struct Event {
+        uint64_t start_ns = 0;
+        uint64_t duration_ns = 0;
+        // Position + 1 of the path in the label ring, 0 for none.
+        uint64_t label = 0;
+        uint32_t async_id = 0;
+        SpanKind kind = SpanKind::Enumerate;
+    };
+
+    struct Buffer {
+        std::vector<Event> events;
+        uint64_t count = 0;
+        std::vector<std::string> labels;
+        uint64_t label_count = 0;
+    };
+
+    Buffer& local() {
+        Buffer& buffer = buffers_.local();
+        if (buffer.events.empty()) {
+            buffer.events.resize(events_per_thread_);
+            buffer.labels.resize(kLabelsPerThread);
+        }
+        return buffer;
+    }
+
+    static const char* spanName(SpanKind kind) {
+        switch (kind) {
+        case SpanKind::Enumerate:
+            return "enumerate";
+        case SpanKind::QueueWait:
+            return "queue wait";
+        case SpanKind::Open:
+            return "open";
+        case SpanKind::Read:
+            return "read";
+        case SpanKind::Close:
+            return "close";
+        }
+        return "span";
+    }
+
+    // Names a thread after the first span it recorded.
+    static const char* threadName(const Buffer& buffer) {
+        const Event& first = buffer.events[buffer.count > buffer.events.size() ? buffer.count % buffer.events.size() : 0];
+        if (first.kind == SpanKind::Enumerate) {
+            return "traversal";
+        }
+        return first.async_id != 0 ? "io_uring worker" : "worker";
+    }
+
+    static void appendSeparator(std::string& text, bool& first) {
+        if (!first) {
+            text += ",\n";
+        }
+        first = false;
+    }
+
+    static std::string escape(const std::string& text) {
+        std::string result;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                result += escaped;
+            }
+            else {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    void appendEvent(std::string& text, bool& first, const Buffer& buffer, const Event& event, unsigned thread_id) const {
+        // Timestamps are microseconds since the tracer was created.
+        double start_us = (static_cast<double>(event.start_ns) - static_cast<double>(start_ns_)) / 1e3;
+        double duration_us = event.duration_ns / 1e3;
+        const char* name = spanName(event.kind);
+        char line[256];
+        if (event.async_id != 0) {
+            // Slots are reused, so the id also carries the thread to keep it unique.
+            unsigned long long id = (static_cast<unsigned long long>(thread_id) << 32) | event.async_id;
+            appendSeparator(text, first);
+            std::snprintf(line, sizeof(line), "{\"name\": \"%s\", \"cat\": \"uring\", \"ph\": \"b\", \"id\": %llu, \"pid\": 1, \"tid\": %u, \"ts\": %.3f}", name, id,
+                          thread_id, start_us);
+            text += line;
+            appendSeparator(text, first);
+            std::snprintf(line, sizeof(line), "{\"name\": \"%s\", \"cat\": \"uring\", \"ph\": \"e\", \"id\": %llu, \"pid\": 1, \"tid\": %u, \"ts\": %.3f}", name, id,
+                          thread_id, start_us + duration_us);
+            text += line;
+            return;
+        }
+        appendSeparator(text, first);
+        std::snprintf(line, sizeof(line), "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f", name, thread_id, start_us, duration_us);
+        text += line;
+        // Paths whose place in the label ring was taken by a newer one are left out.
+        if (event.label != 0 && event.label + buffer.labels.size() > buffer.label_count) {
+            text += ", \"args\": {\"path\": \"" + escape(buffer.labels[(event.label - 1) % buffer.labels.size()]) + "\"}";
+        }
+        text += "}";
+    }
+
+    const size_t events_per_thread_;
+    const uint64_t start_ns_;
+    PerThread<Buffer> buffers_;
+};
+
+// Records a span from its construction to its destruction, if there is a tracer.
+class TraceScope {
+public:
+    TraceScope(Tracer* tracer, SpanKind kind, const std::filesystem::path* path = nullptr)
+        : tracer_(tracer), kind_(kind), path_(path), start_ns_(tracer != nullptr ? monotonicNanoseconds() : 0) {}
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    ~TraceScope() {
+        if (tracer_ == nullptr) {
+            return;
+        }
+        if (path_ != nullptr) {
+            tracer_->record(kind_, start_ns_, monotonicNanoseconds(), *path_);
+        }
+        else {
+            tracer_->record(kind_, start_ns_, monotonicNanoseconds());
+        }
+    }
+
+private:
+    Tracer* tracer_;
+    SpanKind kind_;
+    const std::filesystem::path* path_;
+    uint64_t start_ns_;
+};
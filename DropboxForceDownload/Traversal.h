@@ -0,0 +1,370 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <cerrno>
+#endif
+
+#include "DirectorySnapshot.h"
+#include "FileBatch.h"
+#include "Options.h"
+#include "RunContext.h"
+#include "WorkStealingDeque.h"
+
+// Function to get the name of a directory entry as the tail of its path, without the
+// allocation of path::filename.
+inline FileName entryName(const std::filesystem::directory_entry& entry) {
+#ifdef _WIN32
+    const wchar_t* separators = L"/\\";
+#else
+    const char* separators = "/";
+#endif
+    const auto& path = entry.path().native();
+    size_t separator = path.find_last_of(separators);
+    return path.c_str() + (separator == std::filesystem::path::string_type::npos ? 0 : separator + 1);
+}
+
+// Enumerates one directory with std::filesystem. Files are queued in batches, subdirectories
+// are passed to on_directory. The directory_entry members use the file type that came with
+// the directory listing and only stat the entry when the type is unknown or a symlink.
+template <typename Queue, typename OnDirectory>
+void enumerateDirectoryWithIterator(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) {
+    BatchWriter<Queue> batch(files, context.options.batch_size, directory, context.progress);
+    for (const auto& entry : std::filesystem::directory_iterator(directory->path)) {
+        if (entry.is_regular_file()) {
+            batch.add(entryName(entry));
+        }
+        else if (entry.is_directory()) {
+            on_directory(std::make_shared<const Directory>(entry.path()));
+        }
+    }
+    batch.flush();
+}
+
+#ifndef _WIN32
+// Function to throw the same kind of error as the std::filesystem traversal.
+[[noreturn]] inline void throwFilesystemError(const char* what, const std::filesystem::path& path) {
+    throw std::filesystem::filesystem_error(what, path, std::error_code(errno, std::generic_category()));
+}
+
+// Function to open a directory for the dirfd traversal.
+inline DirectoryPtr openDirectory(const std::filesystem::path& directory_path) {
+    int fd = open(directory_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throwFilesystemError("Unable to open directory", directory_path);
+    }
+    return std::make_shared<const Directory>(directory_path, fd);
+}
+
+// Every queued batch keeps its directory open, so the dirfd traversal can hold many more
+// descriptors than the default soft limit allows. Raise it as far as the hard limit.
+inline void raiseOpenFileLimit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Function to open a second descriptor for reading the entries of a directory, so reading
+// does not move the offset of the descriptor that workers use.
+inline int openDirectoryStream(const Directory& directory) {
+    int stream_fd = openat(directory.fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (stream_fd < 0) {
+        throwFilesystemError("Unable to open directory", directory.path);
+    }
+    return stream_fd;
+}
+
+// Queues a file or passes on a subdirectory found by the dirfd traversal. The type reported
+// by the directory listing is trusted, fstatat on the relative name is only needed when the
+// file system does not report it (DT_UNKNOWN) or for symlinks, which are followed like
+// fs::status does. Subdirectories are opened with openat, so the kernel never has to walk
+// the full path again.
+template <typename Queue, typename OnDirectory>
+void addEntryAt(const DirectoryPtr& directory, const char* name, unsigned char type, BatchWriter<Queue>& batch, OnDirectory& on_directory) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;
+    }
+
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat status;
+        if (fstatat(directory->fd, name, &status, 0) != 0) {
+            // Vanished files and broken symlinks are skipped, like fs::status reports them as not found.
+            if (errno == ENOENT) {
+                return;
+            }
+            throwFilesystemError("Unable to get file status", directory->path / name);
+        }
+        type = S_ISREG(status.st_mode) ? DT_REG : S_ISDIR(status.st_mode) ? DT_DIR : DT_UNKNOWN;
+    }
+
+    if (type == DT_REG) {
+        batch.add(name);
+    }
+    else if (type == DT_DIR) {
+        int child_fd = openat(directory->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child_fd < 0) {
+            throwFilesystemError("Unable to open directory", directory->path / name);
+        }
+        on_directory(std::make_shared<const Directory>(directory->path / name, child_fd));
+    }
+}
+
+// Enumerates one directory through its descriptor with readdir.
+template <typename Queue, typename OnDirectory>
+void enumerateDirectoryAt(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) {
+    int stream_fd = openDirectoryStream(*directory);
+    std::unique_ptr<DIR, int (*)(DIR*)> stream(fdopendir(stream_fd), closedir);
+    if (!stream) {
+        close(stream_fd);
+        throwFilesystemError("Unable to read directory", directory->path);
+    }
+
+    BatchWriter<Queue> batch(files, context.options.batch_size, directory, context.progress);
+    while (true) {
+        errno = 0;
+        dirent* entry = readdir(stream.get());
+        if (entry == nullptr) {
+            if (errno != 0) {
+                throwFilesystemError("Unable to read directory", directory->path);
+            }
+            break;
+        }
+        addEntryAt(directory, entry->d_name, entry->d_type, batch, on_directory);
+    }
+    batch.flush();
+}
+
+#ifdef __linux__
+// Size of the buffer getdents64 fills per call, large enough for most directories in one call.
+constexpr size_t kGetdentsBufferSize = 256 * 1024;
+
+// Record layout returned by the getdents64 system call.
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// Enumerates one directory through its descriptor with the getdents64 system call and a
+// large per-thread buffer, so big directories take few system calls. Subdirectories are
+// passed on after each buffer is parsed, because the recursive traversal reuses the buffer.
+template <typename Queue, typename OnDirectory>
+void enumerateDirectoryGetdents(const DirectoryPtr& directory, Queue& files, const RunContext& context, OnDirectory on_directory) {
+    static thread_local std::vector<char> buffer(kGetdentsBufferSize);
+    int stream_fd = openDirectoryStream(*directory);
+    std::unique_ptr<int, void (*)(int*)> stream_guard(&stream_fd, [](int* fd) { close(*fd); });
+
+    BatchWriter<Queue> batch(files, context.options.batch_size, directory, context.progress);
+    std::vector<DirectoryPtr> subdirectories;
+    auto collect = [&](DirectoryPtr subdirectory) { subdirectories.push_back(std::move(subdirectory)); };
+    while (true) {
+        long bytes = syscall(SYS_getdents64, stream_fd, buffer.data(), buffer.size());
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwFilesystemError("Unable to read directory", directory->path);
+        }
+        if (bytes == 0) {
+            break;
+        }
+        for (long offset = 0; offset < bytes;) {
+            const auto* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            addEntryAt(directory, entry->d_name, entry->d_type, batch, collect);
+        }
+        for (auto& subdirectory : subdirectories) {
+            on_directory(std::move(subdirectory));
+        }
+        subdirectories.clear();
+    }
+    batch.flush();
+}
+#endif
+#endif
+
+// Function to open a subdirectory remembered by the snapshot without listing its parent.
+// Returns null if it is gone.
+inline DirectoryPtr openKnownSubdirectory(const Directory& directory, const std::filesystem::path::string_type& name) {
+#ifndef _WIN32
+    if (directory.fd >= 0) {
+        int child_fd = openat(directory.fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child_fd < 0) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                return nullptr;
+            }
+            throwFilesystemError("Unable to open directory", directory.path / name);
+        }
+        return std::make_shared<const Directory>(directory.path / name, child_fd);
+    }
+#endif
+    std::error_code error;
+    if (!std::filesystem::is_directory(directory.path / name, error)) {
+        return nullptr;
+    }
+    return std::make_shared<const Directory>(directory.path / name);
+}
+
+// Enumerates one directory. With a snapshot, a directory that is unchanged since a run that
+// hydrated all its files is not listed, only its remembered subdirectories are passed on.
+// Listed directories are recorded for the next run. A directory that cannot be stamped has no
+// record, so its parent is marked incomplete and listed again next run instead of being
+// reused without it. Directories are listed by the file system operations of the run, see
+// FileSystemOps.h.
+template <typename Ops, typename Queue, typename OnDirectory>
+void enumerateDirectory(const DirectoryPtr& directory, Queue& files, const RunContext& context, const Ops& ops, OnDirectory on_directory) {
+    TraceScope span(context.tracer, SpanKind::Enumerate, &directory->path);
+    DirectorySnapshot* snapshot = context.snapshot;
+    DirectoryStamp stamp;
+    if (snapshot == nullptr) {
+        ops.list(directory, files, context, on_directory);
+        return;
+    }
+    if (!stampDirectory(*directory, stamp)) {
+        if (directory->parent_outcome != nullptr) {
+            directory->parent_outcome->complete.store(false, std::memory_order_relaxed);
+        }
+        ops.list(directory, files, context, on_directory);
+        return;
+    }
+
+    std::vector<std::filesystem::path::string_type> subdirectories;
+    if (snapshot->reuse(*directory, stamp, subdirectories)) {
+        for (const auto& name : subdirectories) {
+            if (DirectoryPtr subdirectory = openKnownSubdirectory(*directory, name)) {
+                subdirectory->parent_outcome = directory->outcome;
+                on_directory(std::move(subdirectory));
+            }
+        }
+        return;
+    }
+
+    directory->outcome = snapshot->startRecord(*directory, stamp);
+    uint64_t subdirectory_count = 0;
+    ops.list(directory, files, context, [&](DirectoryPtr subdirectory) {
+        ++subdirectory_count;
+        subdirectory->parent_outcome = directory->outcome;
+        on_directory(std::move(subdirectory));
+    });
+    snapshot->finishRecord(directory->outcome, subdirectory_count);
+}
+
+// Recursive function to traverse directories and enqueue files for processing.
+// Pushing blocks while the queue is full, which throttles the traversal to the speed of the workers.
+template <typename Ops, typename Queue>
+void traverseDirectory(const DirectoryPtr& directory, Queue& files, const RunContext& context, const Ops& ops) {
+    enumerateDirectory(directory, files, context, ops, [&](const DirectoryPtr& subdirectory) {
+        traverseDirectory(subdirectory, files, context, ops);
+    });
+}
+
+// Parallel counterpart of traverseDirectory. Directories are work items in per-thread deques
+// and threads that run out of work steal subdirectories from the others, so enumeration
+// scales with the number of threads instead of being limited to the main thread. A thread
+// that finds no work parks on a condition variable until a subdirectory is pushed or the
+// traversal ends, so slow listings do not keep idle threads spinning.
+template <typename Ops, typename Queue>
+void parallelTraverseDirectory(const DirectoryPtr& root, unsigned thread_count, Queue& files, const RunContext& context, const Ops& ops) {
+    std::vector<WorkStealingDeque<DirectoryPtr>> deques(thread_count);
+    std::atomic<size_t> pending_directories{ 1 };
+    std::atomic<bool> failed{ false };
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    // Pushes are counted, an idle thread sleeps until the count moves past the one it saw
+    // before it looked for work. Pushing only takes the lock when a thread is parked.
+    std::atomic<uint64_t> pushed{ 0 };
+    std::atomic<unsigned> parked{ 0 };
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    auto wakeAll = [&]() {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle.notify_all();
+    };
+
+    deques[0].push(root);
+
+    auto traverser = [&](unsigned index) {
+        while (pending_directories.load(std::memory_order_acquire) > 0 && !failed.load(std::memory_order_relaxed)) {
+            uint64_t seen = pushed.load();
+            DirectoryPtr directory;
+            bool found = deques[index].pop(directory);
+            for (unsigned offset = 1; !found && offset < thread_count; ++offset) {
+                found = deques[(index + offset) % thread_count].steal(directory);
+            }
+            if (!found) {
+                std::unique_lock<std::mutex> lock(idle_mutex);
+                parked.fetch_add(1);
+                idle.wait(lock, [&]() {
+                    return pushed.load() != seen || pending_directories.load(std::memory_order_acquire) == 0 || failed.load(std::memory_order_relaxed);
+                });
+                parked.fetch_sub(1);
+                continue;
+            }
+
+            // Files go straight to the worker queue, subdirectories onto this thread's deque
+            // where other threads can steal them.
+            try {
+                enumerateDirectory(directory, files, context, ops, [&](DirectoryPtr subdirectory) {
+                    pending_directories.fetch_add(1, std::memory_order_relaxed);
+                    deques[index].push(std::move(subdirectory));
+                    pushed.fetch_add(1);
+                    if (parked.load() > 0) {
+                        std::lock_guard<std::mutex> lock(idle_mutex);
+                        idle.notify_one();
+                    }
+                });
+            }
+            catch (...) {
+                {
+                    std::lock_guard<std::mutex> guard(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                failed.store(true, std::memory_order_relaxed);
+                wakeAll();
+            }
+            if (pending_directories.fetch_sub(1, std::memory_order_release) == 1) {
+                wakeAll();
+            }
+        }
+    };
+
+    std::vector<std::thread> traversers;
+    for (unsigned i = 0; i < thread_count; ++i) {
+        traversers.emplace_back(traverser, i);
+    }
+    for (auto& thread : traversers) {
+        thread.join();
+    }
+
+    // Same behaviour as the recursive traversal: the first error aborts the run.
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,456 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "FileBatch.h"
+#include "FileReaders.h"
+#include "HydrationState.h"
+#include "LatencyHistogram.h"
+#include "Logger.h"
+#include "Progress.h"
+#include "Tracer.h"
+
+
+// Hydrates files through io_uring, talking to the kernel with the raw system calls. Every
+// file is a small state machine of an openat, the reads of the hydration plan and a close,
+// and up to `depth` files are in flight at once, so a single thread keeps hundreds of opens
+// waiting on the sync provider instead of blocking on one at a time. The data read is not
+// used, so all files read into one shared buffer.
+class UringHydrator {
+public:
+    UringHydrator(unsigned depth, const HydrationPlan& plan = HydrationPlan(), HydrationState* state = nullptr, Progress* progress = nullptr,
+                  LatencyStats* latency = nullptr, Tracer* tracer = nullptr)
+        : plan_(plan), state_(state), progress_(progress), latency_(latency), tracer_(tracer), buffer_(plan.bufferSize()), slots_(depth) {
+        // One entry more than the slots, for the timeout of wait.
+        io_uring_params params{};
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, depth + 1, &params));
+        if (ring_fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        }
+        try {
+            mapRings(params);
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+
+        for (unsigned i = 0; i < depth; ++i) {
+            free_slots_.push_back(depth - 1 - i);
+        }
+    }
+
+    UringHydrator(const UringHydrator&) = delete;
+    UringHydrator& operator=(const UringHydrator&) = delete;
+
+    ~UringHydrator() {
+        release();
+    }
+
+    // Checks whether the kernel allows io_uring, it is often disabled in containers, and offers
+    // the requests the hydrator queues.
+    static bool isSupported() {
+        try {
+            UringHydrator probe(1);
+            return probe.supportsRequests();
+        }
+        catch (const std::system_error&) {
+            return false;
+        }
+    }
+
+    // Queues a file for hydration. Waits for completions while every slot is busy. Files in a
+    // directory with a descriptor are opened relative to it. If an identity is given, it is
+    // recorded in the state file once the file has been read.
+    void add(const DirectoryPtr& directory, FileName name, const FileIdentity* identity = nullptr) {
+        while (free_slots_.empty()) {
+            submitAndReap(1);
+        }
+        unsigned index = free_slots_.back();
+        free_slots_.pop_back();
+
+        Slot& slot = slots_[index];
+        slot.directory = directory;
+        if (directory->fd >= 0) {
+            slot.name = name;
+        }
+        else {
+            slot.name = (directory->path / name).native();
+        }
+        slot.fd = -1;
+        slot.record = identity != nullptr;
+        if (identity != nullptr) {
+            slot.identity = *identity;
+        }
+        logger.log(LogLevel::Debug, "Downloading file: ", QueuedFilePath{ *directory, name });
+
+        slot.direct = plan_.direct();
+        slot.noatime = true;
+        queueOpen(index);
+        slot.started_ns = latency_ != nullptr || tracer_ != nullptr ? monotonicNanoseconds() : 0;
+    }
+
+    // Submits queued requests and handles the completions that are already available.
+    void submit() {
+        submitAndReap(0);
+    }
+
+    // Whether files are in flight.
+    bool busy() const {
+        return free_slots_.size() < slots_.size();
+    }
+
+    // Submits queued requests and waits until one completes or the timeout passes, then
+    // handles the completions. The timeout is a request of its own, so the wait stays in the kernel.
+    void wait(std::chrono::nanoseconds timeout) {
+        if (!timeout_pending_) {
+            timeout_.tv_sec = static_cast<long long>(timeout.count() / 1000000000);
+            timeout_.tv_nsec = static_cast<long long>(timeout.count() % 1000000000);
+            io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = reinterpret_cast<uint64_t>(&timeout_);
+            sqe->len = 1;
+            sqe->user_data = kTimeoutData;
+            timeout_pending_ = true;
+        }
+        submitAndReap(1);
+    }
+
+    // Waits until every queued file has been hydrated.
+    void drain() {
+        while (free_slots_.size() < slots_.size()) {
+            submitAndReap(1);
+        }
+    }
+
+private:
+    enum class Stage { Open, Read, Close };
+
+    // User data of the timeout request, slots use their index.
+    static constexpr uint64_t kTimeoutData = ~uint64_t(0);
+
+    struct Slot {
+        DirectoryPtr directory;
+        std::string name;
+        int fd = -1;
+        Stage stage = Stage::Open;
+        bool record = false;
+        FileIdentity identity;
+        // When the current request was queued, for the latency of the open and of the reads.
+        uint64_t started_ns = 0;
+        // Size of the file if the plan needs it, the current read, and the bytes and time of the reads so far.
+        uint64_t size = 0;
+        HydrationPlan::Read read;
+        uint64_t bytes = 0;
+        uint64_t read_ns = 0;
+        // Whether the file is opened with O_DIRECT, cleared when the file system refuses it.
+        bool direct = false;
+        // Whether the file is opened with O_NOATIME, cleared when the caller does not own it.
+        bool noatime = true;
+    };
+
+    // Function to check that the ring offers openat, read, close and timeout. Kernels 5.1 to
+    // 5.5 create a ring but complete these requests with EINVAL, and do not know the probe either.
+    bool supportsRequests() const {
+        constexpr unsigned kProbedOps = 64;
+        std::vector<char> memory(sizeof(io_uring_probe) + kProbedOps * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(memory.data());
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE, probe, kProbedOps) < 0) {
+            return false;
+        }
+        for (unsigned op : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE, IORING_OP_TIMEOUT }) {
+            if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void mapRings(const io_uring_params& params) {
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
+        sq_ring_ = mapRing(sq_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ : mapRing(cq_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(mapRing(sqes_size_, IORING_OFF_SQES));
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    void release() {
+        if (sqes_ != nullptr) {
+            munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_size_);
+        }
+        if (sq_ring_ != nullptr) {
+            munmap(sq_ring_, sq_size_);
+        }
+        if (ring_fd_ >= 0) {
+            close(ring_fd_);
+        }
+    }
+
+    void* mapRing(size_t size, off_t offset) {
+        void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+        if (address == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+        }
+        return address;
+    }
+
+    // Every slot and the timeout have at most one request in flight, so the submission queue
+    // never overflows.
+    io_uring_sqe* nextSqe() {
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit_;
+        return sqe;
+    }
+
+    // Submits the queued requests and handles the completions. When the kernel refuses the
+    // submission for now, with EBUSY because the completion queue overflowed, the completions
+    // are still handled, so the next call can submit.
+    void submitAndReap(unsigned min_complete) {
+        if (to_submit_ > 0 || min_complete > 0) {
+            long result = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (result >= 0) {
+                to_submit_ -= static_cast<unsigned>(result);
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data == kTimeoutData) {
+                timeout_pending_ = false;
+                continue;
+            }
+            complete(static_cast<unsigned>(cqe.user_data), cqe.res);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    void queueOpen(unsigned index) {
+        Slot& slot = slots_[index];
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = slot.directory->fd >= 0 ? slot.directory->fd : AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.name.c_str());
+        sqe->open_flags = O_RDONLY | O_CLOEXEC | (slot.direct ? O_DIRECT : 0) | (slot.noatime ? O_NOATIME : 0);
+        sqe->user_data = index;
+    }
+
+    void queueRead(unsigned index) {
+        Slot& slot = slots_[index];
+        slot.stage = Stage::Read;
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = slot.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer_.data());
+        sqe->len = static_cast<uint32_t>(slot.read.length);
+        sqe->off = slot.read.offset;
+        sqe->user_data = index;
+    }
+
+    // Function to log a file that could not be hydrated. The name of a slot is relative to its
+    // directory if the directory has a descriptor, and the full path otherwise.
+    static void logFailure(const char* what, const Slot& slot) {
+        if (slot.directory->fd >= 0) {
+            logger.log(LogLevel::Error, what, QueuedFilePath{ *slot.directory, slot.name.c_str() });
+        }
+        else {
+            logger.log(LogLevel::Error, what, slot.name);
+        }
+    }
+
+    // Counts a file whose reads are done and queues its close. A file whose last read failed
+    // is counted as failed like one that could not be opened, its directory is not complete,
+    // and it is neither recorded in the state file nor are its pages dropped.
+    void finishReads(unsigned index, int result) {
+        Slot& slot = slots_[index];
+        if (result >= 0) {
+            if (latency_ != nullptr) {
+                latency_->recordRead(slot.read_ns);
+            }
+            if (slot.record && state_ != nullptr) {
+                state_->record(slot.identity);
+            }
+            if (plan_.dropCache()) {
+                dropCachedPages(slot.fd);
+            }
+            if (progress_ != nullptr) {
+                progress_->addHydrated(slot.bytes);
+            }
+        }
+        else {
+            logFailure("Unable to read file: ", slot);
+            slot.directory->markIncomplete();
+            if (progress_ != nullptr) {
+                progress_->addFailed(-result);
+            }
+        }
+        slot.stage = Stage::Close;
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = slot.fd;
+        sqe->user_data = index;
+    }
+
+    // Advances a file to its next request, open -> reads -> close.
+    void complete(unsigned index, int result) {
+        Slot& slot = slots_[index];
+        // A file system that does not support O_DIRECT refuses the open, and O_NOATIME is only
+        // allowed for the owner of the file, so like openForReading the open is retried without
+        // them. All attempts count as the open.
+        if (slot.stage == Stage::Open && result == -EINVAL && slot.direct) {
+            slot.direct = false;
+            queueOpen(index);
+            return;
+        }
+        if (slot.stage == Stage::Open && result == -EPERM && slot.noatime) {
+            slot.noatime = false;
+            queueOpen(index);
+            return;
+        }
+        if (latency_ != nullptr || tracer_ != nullptr) {
+            uint64_t now = monotonicNanoseconds();
+            if (latency_ != nullptr && slot.stage == Stage::Open) {
+                latency_->recordOpen(now - slot.started_ns);
+            }
+            else if (slot.stage == Stage::Read) {
+                slot.read_ns += now - slot.started_ns;
+            }
+            if (tracer_ != nullptr) {
+                SpanKind kind = slot.stage == Stage::Open ? SpanKind::Open : slot.stage == Stage::Read ? SpanKind::Read : SpanKind::Close;
+                tracer_->record(kind, slot.started_ns, now, index + 1);
+            }
+            slot.started_ns = now;
+        }
+        switch (slot.stage) {
+        case Stage::Open:
+            if (result < 0) {
+                logFailure("Unable to open file: ", slot);
+                slot.directory->markIncomplete();
+                if (progress_ != nullptr) {
+                    progress_->addFailed(-result);
+                }
+                slot.directory.reset();
+                free_slots_.push_back(index);
+                return;
+            }
+            slot.fd = result;
+            slot.size = 0;
+            slot.bytes = 0;
+            slot.read_ns = 0;
+            if (plan_.needsSize()) {
+                // A blocking fstat, a statx request would cost another round trip through the ring.
+                struct stat status;
+                if (fstat(slot.fd, &status) == 0) {
+                    slot.size = static_cast<uint64_t>(status.st_size);
+                }
+                // Without the size, O_DIRECT would read at the unaligned end, see readFileAt.
+                else if (plan_.direct()) {
+                    finishReads(index, -errno);
+                    return;
+                }
+            }
+            if (plan_.sequential() && !slot.direct) {
+                adviseSequential(slot.fd);
+            }
+            if (plan_.first(slot.size, slot.read)) {
+                queueRead(index);
+            }
+            else {
+                finishReads(index, 0);
+            }
+            return;
+        case Stage::Read:
+            if (result > 0) {
+                slot.bytes += static_cast<uint64_t>(result);
+            }
+            if (result >= 0 && plan_.next(slot.size, slot.read, static_cast<size_t>(result))) {
+                queueRead(index);
+            }
+            else {
+                finishReads(index, result);
+            }
+            return;
+        case Stage::Close:
+            slot.stage = Stage::Open;
+            slot.fd = -1;
+            slot.directory.reset();
+            free_slots_.push_back(index);
+            return;
+        }
+    }
+
+    const HydrationPlan plan_;
+    HydrationState* state_;
+    Progress* progress_;
+    LatencyStats* latency_;
+    Tracer* tracer_;
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned to_submit_ = 0;
+    __kernel_timespec timeout_{};
+    bool timeout_pending_ = false;
+    AlignedBuffer buffer_;
+    std::vector<Slot> slots_;
+    std::vector<unsigned> free_slots_;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+
+// Double-ended work queue owned by one thread. The owner pushes and pops at the back,
+// so it walks its own part of the tree depth first, while idle threads steal from the
+// front, which holds the oldest and usually largest subtrees. Work items are whole
+// directories, so a plain mutex per deque is cheap compared to enumerating them.
+template <typename T>
+class WorkStealingDeque {
+public:
+    void push(T item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        items_.push_back(std::move(item));
+    }
+
+    // Called by the owning thread.
+    bool pop(T& item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.back());
+        items_.pop_back();
+        return true;
+    }
+
+    // Called by any other thread.
+    bool steal(T& item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<T> items_;
+};
@@ -0,0 +1,587 @@
+#include <iostream>
+#include <filesystem>
+#include <vector>
+#include <thread>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <cmath>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include "../DropboxForceDownload/BoundedQueue.h"
+#include "../DropboxForceDownload/FileReaders.h"
+#include "../DropboxForceDownload/MpmcRing.h"
+#include "../DropboxForceDownload/Pipeline.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// Used by the pipeline, which logs errors directly since the logger thread is not started.
+std::mutex console_mutex;
+Logger logger;
+
+// Settings for the queue microbenchmark.
+struct QueueBenchmarkOptions {
+    size_t items = 2000000;
+    unsigned producers = 1;
+    unsigned consumers = 4;
+    size_t capacity = 65536;
+};
+
+// Function to push items from several producers to several consumers and report the throughput.
+// The payload is an fs::path, like the paths the traversal hands to the workers.
+template <typename Queue>
+void benchmarkQueue(const char* name, const QueueBenchmarkOptions& options) {
+    Queue queue(options.capacity);
+    std::atomic<size_t> consumed{ 0 };
+    const fs::path payload = fs::path("Dropbox") / "Projects" / "2023" / "report.docx";
+
+    auto start = Clock::now();
+
+    std::vector<std::thread> consumers;
+    for (unsigned i = 0; i < options.consumers; ++i) {
+        consumers.emplace_back([&] {
+            fs::path item;
+            size_t count = 0;
+            while (queue.pop(item)) {
+                ++count;
+            }
+            consumed.fetch_add(count, std::memory_order_relaxed);
+        });
+    }
+
+    std::vector<std::thread> producers;
+    for (unsigned i = 0; i < options.producers; ++i) {
+        size_t share = options.items / options.producers + (i < options.items % options.producers ? 1 : 0);
+        producers.emplace_back([&, share] {
+            for (size_t n = 0; n < share; ++n) {
+                queue.push(payload);
+            }
+        });
+    }
+
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    queue.close();
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << name << ": " << consumed.load() << " items in " << seconds << " s, "
+              << static_cast<size_t>(consumed.load() / seconds) << " items/s, high-water mark "
+              << queue.highWaterMark() << std::endl;
+}
+
+// Settings for the reader benchmark.
+struct ReaderBenchmarkOptions {
+    size_t files = 20000;
+    size_t files_per_directory = 100;
+    size_t file_size = 4096;
+    size_t rounds = 3;
+    fs::path directory = fs::temp_directory_path() / "DropboxForceDownloadBench";
+};
+
+// Function to create a flat synthetic tree of equally sized files and return their paths.
+std::vector<fs::path> createSyntheticTree(const fs::path& root, size_t files, size_t files_per_directory, size_t file_size) {
+    std::vector<fs::path> paths;
+    std::string content(file_size, 'x');
+    for (size_t i = 0; i < files; ++i) {
+        fs::path directory = root / ("dir" + std::to_string(i / files_per_directory));
+        if (i % files_per_directory == 0) {
+            fs::create_directories(directory);
+        }
+        fs::path file_path = directory / ("file" + std::to_string(i) + ".bin");
+        std::ofstream(file_path, std::ios::binary).write(content.data(), content.size());
+        paths.push_back(file_path);
+    }
+    return paths;
+}
+
+// Function to read the head of every file with the given reader and report the throughput.
+// The first round warms the page cache, so the numbers measure the per-file overhead of the
+// reader rather than the disk.
+template <typename ReadHead>
+void benchmarkReader(const char* name, const std::vector<fs::path>& paths, size_t rounds, ReadHead read_head) {
+    HydrationPlan plan;
+    for (size_t round = 0; round <= rounds; ++round) {
+        auto start = Clock::now();
+        size_t failed = 0;
+        for (const auto& file_path : paths) {
+            if (read_head(file_path, plan, nullptr) < 0) {
+                ++failed;
+            }
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if (round == 0) {
+            continue;
+        }
+        std::cout << name << " round " << round << ": " << paths.size() << " files in " << seconds << " s, "
+                  << static_cast<size_t>(paths.size() / seconds) << " files/s";
+        if (failed > 0) {
+            std::cout << ", " << failed << " failed";
+        }
+        std::cout << std::endl;
+    }
+}
+
+// Function to compare the std::ifstream and POSIX readers on a synthetic tree.
+// The tree is created in a new directory and removed afterwards.
+void runReaderBenchmark(const ReaderBenchmarkOptions& options) {
+    if (fs::exists(options.directory)) {
+        throw std::runtime_error("Benchmark directory already exists: " + options.directory.string());
+    }
+    std::vector<fs::path> paths = createSyntheticTree(options.directory, options.files, options.files_per_directory, options.file_size);
+    std::cout << paths.size() << " files of " << options.file_size << " bytes in " << options.directory << std::endl;
+
+    benchmarkReader("ifstream", paths, options.rounds, readFileWithStream);
+#ifndef _WIN32
+    benchmarkReader("posix", paths, options.rounds, readFileWithPosix);
+#endif
+
+    fs::remove_all(options.directory);
+}
+
+// Settings for the synthetic tree of the pipeline benchmark.
+struct TreeOptions {
+    unsigned depth = 3;
+    unsigned fanout = 8;
+    size_t files = 20000;
+    size_t min_size = 1024;
+    size_t max_size = 16384;
+    bool sparse = false;
+    uint64_t seed = 1;
+};
+
+// Settings for the pipeline benchmark.
+struct PipelineBenchmarkOptions {
+    TreeOptions tree;
+    size_t rounds = 3;
+    fs::path directory = fs::temp_directory_path() / "DropboxForceDownloadBench";
+};
+
+// Function to draw the next number of a SplitMix64 sequence, which gives the same tree for
+// the same seed with every standard library.
+uint64_t nextRandom(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Function to create a tree of `depth` levels below the root with `fanout` subdirectories
+// each, and spread the files evenly over all directories. File sizes are log-uniform between
+// the minimum and the maximum, so there are many small and a few large files. Sparse files
+// have their size but no data blocks, like online-only placeholders. Returns the total size.
+uint64_t createBenchmarkTree(const fs::path& root, const TreeOptions& options) {
+    std::vector<fs::path> directories{ root };
+    fs::create_directories(root);
+    for (size_t level = 0, begin = 0; level < options.depth; ++level) {
+        size_t end = directories.size();
+        for (size_t i = begin; i < end; ++i) {
+            for (unsigned child = 0; child < options.fanout; ++child) {
+                directories.push_back(directories[i] / ("dir" + std::to_string(child)));
+                fs::create_directory(directories.back());
+            }
+        }
+        begin = end;
+    }
+
+    uint64_t random = options.seed;
+    std::string content(options.sparse ? 0 : options.max_size, 'x');
+    double ratio = static_cast<double>(options.max_size) / static_cast<double>(options.min_size);
+    uint64_t total = 0;
+    for (size_t i = 0; i < options.files; ++i) {
+        double unit = static_cast<double>(nextRandom(random) >> 11) / 9007199254740992.0;
+        size_t size = std::min(options.max_size, static_cast<size_t>(options.min_size * std::pow(ratio, unit)));
+        fs::path file_path = directories[i % directories.size()] / ("file" + std::to_string(i) + ".bin");
+        std::ofstream file(file_path, std::ios::binary);
+        if (!options.sparse) {
+            file.write(content.data(), static_cast<std::streamsize>(size));
+        }
+        file.close();
+        if (options.sparse) {
+            fs::resize_file(file_path, size);
+        }
+        total += size;
+    }
+    return total;
+}
+
+// Measurements of one pipeline run.
+struct PipelineResult {
+    bool ok = false;
+    uint64_t files = 0;
+    double seconds = 0;
+    // read(2) and write(2) calls from /proc/self/io, which does not count io_uring requests,
+    // -1 where it is not available.
+    int64_t io_syscalls = -1;
+    // Voluntary and involuntary context switches, -1 where they are not available.
+    int64_t context_switches = -1;
+    // Peak resident set size in KB.
+    uint64_t peak_rss_kb = 0;
+};
+
+// Function to read the read and write system call counts of this process (Linux only).
+int64_t readIoSyscalls() {
+#ifdef __linux__
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    int64_t value = 0;
+    int64_t total = 0;
+    int found = 0;
+    while (io >> key >> value) {
+        if (key == "syscr:" || key == "syscw:") {
+            total += value;
+            ++found;
+        }
+    }
+    return found == 2 ? total : -1;
+#else
+    return -1;
+#endif
+}
+
+// Function to read the context switches of this process.
+int64_t readContextSwitches() {
+#ifdef _WIN32
+    return -1;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<int64_t>(usage.ru_nvcsw + usage.ru_nivcsw);
+#endif
+}
+
+// Function to run the pipeline once on the tree and measure it in this process.
+PipelineResult measurePipeline(const fs::path& root, const Options& options) {
+    PipelineResult result;
+    int64_t io_before = readIoSyscalls();
+    int64_t switches_before = readContextSwitches();
+    auto start = Clock::now();
+    ProgressTotals totals = startDirectoryTraversal(root, options);
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    int64_t io_after = readIoSyscalls();
+    int64_t switches_after = readContextSwitches();
+    result.ok = true;
+    result.files = totals.done();
+    if (io_before >= 0 && io_after >= 0) {
+        result.io_syscalls = io_after - io_before;
+    }
+    if (switches_before >= 0 && switches_after >= 0) {
+        result.context_switches = switches_after - switches_before;
+    }
+    return result;
+}
+
+// Function to run the pipeline once. On POSIX the run happens in a child process, so the peak
+// RSS belongs to this configuration alone; on Windows it is the peak of the whole benchmark.
+PipelineResult runPipelineOnce(const fs::path& root, const Options& options) {
+#ifdef _WIN32
+    PipelineResult result = measurePipeline(root, options);
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        result.peak_rss_kb = counters.PeakWorkingSetSize / 1024;
+    }
+    return result;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::system_error(errno, std::generic_category(), "pipe");
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        throw std::system_error(errno, std::generic_category(), "fork");
+    }
+    if (child == 0) {
+        close(fds[0]);
+        PipelineResult result;
+        try {
+            result = measurePipeline(root, options);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit(written == static_cast<ssize_t>(sizeof(result)) ? 0 : 1);
+    }
+    close(fds[1]);
+    PipelineResult result;
+    ssize_t received = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    rusage usage{};
+    wait4(child, &status, 0, &usage);
+    if (received != static_cast<ssize_t>(sizeof(result))) {
+        result = PipelineResult{};
+    }
+    // ru_maxrss is in KB on Linux and in bytes on macOS.
+#ifdef __APPLE__
+    result.peak_rss_kb = static_cast<uint64_t>(usage.ru_maxrss) / 1024;
+#else
+    result.peak_rss_kb = static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+    return result;
+#endif
+}
+
+// A named set of options that is compared with the others on the same tree.
+struct PipelineConfiguration {
+    std::string name;
+    Options options;
+};
+
+// Function to list the configurations: the default, and one change of queue, reader,
+// traversal or engine each.
+std::vector<PipelineConfiguration> pipelineConfigurations() {
+    Options defaults;
+    defaults.progress = ProgressDisplay::Never;
+    defaults.log_level = LogLevel::Error;
+
+    std::vector<PipelineConfiguration> configurations;
+    configurations.push_back({ "default", defaults });
+    configurations.push_back({ "mutex queue", defaults });
+    configurations.back().options.queue = QueueKind::Mutex;
+    configurations.push_back({ "ifstream reader", defaults });
+    configurations.back().options.reader = Reader::Stream;
+    configurations.push_back({ "parallel traversal", defaults });
+    configurations.back().options.parallel_traversal = true;
+#ifndef _WIN32
+    configurations.push_back({ "dirfd", defaults });
+    configurations.back().options.dirfd = true;
+    configurations.push_back({ "dirfd, parallel traversal", defaults });
+    configurations.back().options.dirfd = true;
+    configurations.back().options.parallel_traversal = true;
+#endif
+#ifdef __linux__
+    configurations.push_back({ "io_uring, dirfd", defaults });
+    configurations.back().options.engine = Engine::Uring;
+    configurations.back().options.dirfd = true;
+#endif
+    return configurations;
+}
+
+// Function to run every configuration of the pipeline on one synthetic tree and report files/s,
+// system calls and context switches per file and the peak RSS. The first round of each
+// configuration warms the page cache and is not reported. The tree is removed afterwards.
+void runPipelineBenchmark(const PipelineBenchmarkOptions& options) {
+    if (fs::exists(options.directory)) {
+        throw std::runtime_error("Benchmark directory already exists: " + options.directory.string());
+    }
+    uint64_t bytes = createBenchmarkTree(options.directory, options.tree);
+    std::cout << options.tree.files << " files, " << bytes / (1024 * 1024) << " MB" << (options.tree.sparse ? " sparse" : "") << ", depth "
+              << options.tree.depth << ", fan-out " << options.tree.fanout << " in " << options.directory << std::endl;
+
+    for (const PipelineConfiguration& configuration : pipelineConfigurations()) {
+        for (size_t round = 0; round <= options.rounds; ++round) {
+            PipelineResult result = runPipelineOnce(options.directory, configuration.options);
+            if (round == 0) {
+                continue;
+            }
+            std::cout << configuration.name << " round " << round << ": ";
+            if (!result.ok) {
+                std::cout << "failed" << std::endl;
+                continue;
+            }
+            double files = static_cast<double>(std::max<uint64_t>(1, result.files));
+            std::cout << result.files << " files in " << result.seconds << " s, " << static_cast<size_t>(result.files / result.seconds) << " files/s";
+            // Reads through io_uring are not counted by /proc/self/io, so io_uring leaves it out.
+            if (result.io_syscalls >= 0 && configuration.options.engine != Engine::Uring) {
+                std::cout << ", " << result.io_syscalls / files << " read(2)/write(2) calls/file";
+            }
+            if (result.context_switches >= 0) {
+                std::cout << ", " << result.context_switches / files << " context switches/file";
+            }
+            std::cout << ", peak RSS " << result.peak_rss_kb / 1024 << " MB" << std::endl;
+        }
+    }
+
+    fs::remove_all(options.directory);
+}
+
+// Function to parse a positive count from a command line argument.
+bool parseCount(const char* text, size_t& value) {
+    char* end = nullptr;
+    unsigned long long parsed = std::strtoull(text, &end, 10);
+    if (end == text || *end != '\0' || parsed == 0) {
+        return false;
+    }
+    value = static_cast<size_t>(parsed);
+    return true;
+}
+
+// Function to print the command line help.
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " queue [--items <n>] [--producers <n>] [--consumers <n>] [--capacity <n>]" << std::endl
+              << "       " << program << " reader [--files <n>] [--files-per-directory <n>] [--file-size <n>] [--rounds <n>] [--directory <path>]" << std::endl
+              << "       " << program << " pipeline [--files <n>] [--depth <n>] [--fanout <n>] [--min-size <n>] [--max-size <n>] [--sparse] [--seed <n>]" << std::endl
+              << "                [--rounds <n>] [--directory <path>]" << std::endl;
+}
+
+// Function to parse the queue benchmark arguments and run it.
+int queueCommand(int argc, char* argv[]) {
+    QueueBenchmarkOptions options;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t value = 0;
+        if (i + 1 >= argc || !parseCount(argv[++i], value)) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (arg == "--items") {
+            options.items = value;
+        }
+        else if (arg == "--producers") {
+            options.producers = static_cast<unsigned>(value);
+        }
+        else if (arg == "--consumers") {
+            options.consumers = static_cast<unsigned>(value);
+        }
+        else if (arg == "--capacity") {
+            options.capacity = value;
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::cout << options.producers << " producer(s), " << options.consumers << " consumer(s), capacity " << options.capacity << std::endl;
+    benchmarkQueue<BoundedQueue<fs::path>>("mutex", options);
+    benchmarkQueue<MpmcRing<fs::path>>("lockfree", options);
+    return 0;
+}
+
+// Function to parse the reader benchmark arguments and run it.
+int readerCommand(int argc, char* argv[]) {
+    ReaderBenchmarkOptions options;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (arg == "--directory") {
+            options.directory = argv[++i];
+            continue;
+        }
+        size_t value = 0;
+        if (!parseCount(argv[++i], value)) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (arg == "--files") {
+            options.files = value;
+        }
+        else if (arg == "--files-per-directory") {
+            options.files_per_directory = value;
+        }
+        else if (arg == "--file-size") {
+            options.file_size = value;
+        }
+        else if (arg == "--rounds") {
+            options.rounds = value;
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    runReaderBenchmark(options);
+    return 0;
+}
+
+// Function to parse the pipeline benchmark arguments and run it.
+int pipelineCommand(int argc, char* argv[]) {
+    PipelineBenchmarkOptions options;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--sparse") {
+            options.tree.sparse = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (arg == "--directory") {
+            options.directory = argv[++i];
+            continue;
+        }
+        size_t value = 0;
+        if (!parseCount(argv[++i], value)) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (arg == "--files") {
+            options.tree.files = value;
+        }
+        else if (arg == "--depth") {
+            options.tree.depth = static_cast<unsigned>(value);
+        }
+        else if (arg == "--fanout") {
+            options.tree.fanout = static_cast<unsigned>(value);
+        }
+        else if (arg == "--min-size") {
+            options.tree.min_size = value;
+        }
+        else if (arg == "--max-size") {
+            options.tree.max_size = value;
+        }
+        else if (arg == "--seed") {
+            options.tree.seed = value;
+        }
+        else if (arg == "--rounds") {
+            options.rounds = value;
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.tree.min_size > options.tree.max_size) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    runPipelineBenchmark(options);
+    return 0;
+}
+
+// Main function: Entry point of the benchmark.
+int main(int argc, char* argv[]) {
+    std::string command = argc >= 2 ? argv[1] : "";
+    try {
+        if (command == "queue") {
+            return queueCommand(argc, argv);
+        }
+        if (command == "reader") {
+            return readerCommand(argc, argv);
+        }
+        if (command == "pipeline") {
+            return pipelineCommand(argc, argv);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    printUsage(argv[0]);
+    return 1;
+}